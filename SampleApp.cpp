@@ -19,7 +19,7 @@ pthread_mutex_t userInputLock;
 void usage() {
     cout << "SampleApp - a good way to play with the simplified Chord implementation." << endl;
     cout << endl;
-    cout << "  Usage: ./sample -c CHORD_PORT -p APP_PORT [-j IP_ADDRESS_TO_JOIN]" << endl;
+    cout << "  Usage: ./sample -c CHORD_PORT -p APP_PORT [-j IP_ADDRESS_TO_JOIN] [-w WORKER_THREADS]" << endl;
     cout << "      -c CHORD_PORT" << endl;
     cout << "         The port number to use for Chord layer. It is important to keep all Chord port the same" << endl;
     cout << endl;
@@ -29,6 +29,9 @@ void usage() {
     cout << "      -j IP_ADDRESS_TO_JOIN" << endl;
     cout << "         Optional. Specifies which chord ring to join. If not specified, a new Chord ring will be created." << endl;
     cout << endl;
+    cout << "      -w WORKER_THREADS" << endl;
+    cout << "         Optional. Number of threads processing Chord messages (default " << DEFAULT_WORKER_THREADS << ")." << endl;
+    cout << endl;
     cout << "  Command Line" << endl;
     cout << "    help      Displays this help text" << endl;
     cout << endl;
@@ -186,13 +189,13 @@ void commandLoop() {
 }
 
 int main(int argc, char **argv) {
-    unsigned int chordPort = 0, appPort = 0;
+    unsigned int chordPort = 0, appPort = 0, workerThreads = DEFAULT_WORKER_THREADS;
     char *joinNode = NULL;
     
     int optflag;
     
     // Get command line arguments
-    while ((optflag = getopt(argc, argv, "p:c:j:")) != -1) {
+    while ((optflag = getopt(argc, argv, "p:c:j:w:")) != -1) {
         switch (optflag) {
             case 'p':
                 appPort = atoi(optarg);
@@ -216,6 +219,10 @@ int main(int argc, char **argv) {
                 joinNode = optarg;
                 dprt << "   Join IP: " << joinNode;
                 break;
+            case 'w':
+                workerThreads = atoi(optarg);
+                dprt << "   Workers: " << workerThreads;
+                break;
             default:
                 cerr << "[ERROR] Invalid argument." << endl;
                 return -1;
@@ -234,6 +241,8 @@ int main(int argc, char **argv) {
     crd = new Chord(appPort, chordPort);
     // Set join point; if pass in NULL (or not set), the service will be a new standalone network
     crd->setJoinPointIp(joinNode);
+    // Number of threads handling Chord protocol messages
+    crd->setWorkerThreads(workerThreads);
     
     cout << ">> Initing chord" << endl;
     // Attempts to initialize chord
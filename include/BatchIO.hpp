@@ -0,0 +1,177 @@
+#ifndef __BATCH_IO_HPP__
+#define __BATCH_IO_HPP__
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+using namespace std;
+
+/**
+ * Receives up to a fixed number of datagrams per system call (recvmmsg)
+ *
+ * All buffers are allocated once, up front, and reused by every receive().
+ * Alternatively the caller can attach() its own buffers to the slots, e.g. to
+ * hand a received buffer off to another thread and attach a fresh one in its place.
+ * Not thread safe; each receiving thread should own its batch
+ */
+class RecvBatch {
+public:
+    /**
+     * @param   slots       Maximum number of datagrams per receive()
+     * @param   bufsize     Size of each datagram buffer, in bytes
+     * @param   ownBuffers  Whether to allocate the buffers; if false, every slot must be attach()ed
+     */
+    RecvBatch(unsigned int slots, size_t bufsize, bool ownBuffers = true)
+            : buffers(ownBuffers ? slots * bufsize : 0), iovecs(slots), headers(slots) {
+        this->bufsize = bufsize;
+
+        for (unsigned int i = 0; i < slots; ++i) {
+            this->iovecs[i].iov_base = ownBuffers ? &(this->buffers[i * bufsize]) : NULL;
+            this->iovecs[i].iov_len = bufsize;
+        }
+    }
+
+    /**
+     * Makes slot i receive into buf from now on
+     *
+     * @param   i       The slot
+     * @param   buf     Buffer of at least bufsize bytes, owned by the caller
+     */
+    void attach(unsigned int i, unsigned char *buf) {
+        this->iovecs[i].iov_base = buf;
+    }
+
+    /**
+     * Receives as many pending datagrams as fit in the batch without blocking
+     *
+     * @param   fd  The socket to receive from
+     * @return  Number of datagrams received; 0 if none are pending, -1 on error (errno is set)
+     */
+    int receive(int fd) {
+        memset(&(this->headers[0]), 0, this->headers.size() * sizeof(struct mmsghdr));
+        for (unsigned int i = 0; i < this->headers.size(); ++i) {
+            this->headers[i].msg_hdr.msg_iov = &(this->iovecs[i]);
+            this->headers[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int count = recvmmsg(fd, &(this->headers[0]), this->headers.size(), MSG_DONTWAIT, NULL);
+        if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+
+        return count;
+    }
+
+    /**
+     * Returns the i-th datagram of the last receive()
+     */
+    unsigned char *buffer(unsigned int i) { return (unsigned char *) this->iovecs[i].iov_base; }
+
+    /**
+     * Returns the length of the i-th datagram of the last receive()
+     */
+    size_t length(unsigned int i) { return this->headers[i].msg_len; }
+
+    unsigned int capacity() { return this->headers.size(); }
+
+private:
+    size_t bufsize;
+    vector<unsigned char> buffers;
+    vector<struct iovec> iovecs;
+    vector<struct mmsghdr> headers;
+};
+
+/**
+ * Queues outgoing datagrams and sends them with as few system calls as possible (sendmmsg)
+ *
+ * The batch does not copy or own the queued data; it must stay valid until flush() returns.
+ * What flush() could not send can be read back until the next add().
+ * Not thread safe; each sending thread should own its batch
+ */
+class SendBatch {
+public:
+    /**
+     * @param   slots   Maximum number of datagrams queued before add() fails
+     */
+    SendBatch(unsigned int slots) : iovecs(slots), headers(slots) {
+        this->queued = 0;
+    }
+
+    /**
+     * Queues a datagram
+     *
+     * @param   addr    Destination address
+     * @param   addrlen Length of addr
+     * @param   data    The data to send
+     * @param   len     The length of data
+     * @return  False if the batch is full (flush first), true otherwise
+     */
+    bool add(struct sockaddr *addr, socklen_t addrlen, unsigned char *data, size_t len) {
+        if (this->queued == this->headers.size()) {
+            return false;
+        }
+
+        this->iovecs[this->queued].iov_base = data;
+        this->iovecs[this->queued].iov_len = len;
+
+        struct msghdr *hdr = &(this->headers[this->queued].msg_hdr);
+        memset(hdr, 0, sizeof(struct msghdr));
+        hdr->msg_name = addr;
+        hdr->msg_namelen = addrlen;
+        hdr->msg_iov = &(this->iovecs[this->queued]);
+        hdr->msg_iovlen = 1;
+
+        this->queued++;
+        return true;
+    }
+
+    /**
+     * Sends all queued datagrams and empties the batch
+     *
+     * @param   fd  The socket to send through
+     * @return  Number of datagrams sent; -1 if the first one failed (errno is set)
+     */
+    int flush(int fd) {
+        unsigned int sent = 0;
+        bool failed = false;
+
+        while (sent < this->queued) {
+            int ret = sendmmsg(fd, &(this->headers[sent]), this->queued - sent, 0);
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                failed = true;
+                break;
+            }
+
+            sent += ret;
+        }
+
+        this->queued = 0;
+        return (failed && sent == 0) ? -1 : (int) sent;
+    }
+
+    unsigned int size() { return this->queued; }
+    bool full() { return this->queued == this->headers.size(); }
+
+    /**
+     * The i-th datagram queued, also after flush() until the next add()
+     */
+    struct sockaddr *address(unsigned int i) { return (struct sockaddr *) this->headers[i].msg_hdr.msg_name; }
+    socklen_t addressLength(unsigned int i) { return this->headers[i].msg_hdr.msg_namelen; }
+    unsigned char *data(unsigned int i) { return (unsigned char *) this->iovecs[i].iov_base; }
+    size_t length(unsigned int i) { return this->iovecs[i].iov_len; }
+
+private:
+    unsigned int queued;
+    vector<struct iovec> iovecs;
+    vector<struct mmsghdr> headers;
+};
+
+#endif
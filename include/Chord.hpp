@@ -2,15 +2,28 @@
 #define __CHORD_HPP__
 #define CHORD_LENGTH_BIT 32
 
+#include <deque>
 #include <map>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
+#include <netdb.h>
+#include <arpa/inet.h>
 #include <sys/socket.h>
 
+#include "BatchIO.hpp"
 #include "ChordError.hpp"
+#include "EventLoop.hpp"
+#include "LocationCache.hpp"
 #include "MessageHandler.hpp"
+#include "NameResolver.hpp"
+#include "ObjectPool.hpp"
 #include "ServiceNotification.hpp"
+#include "SnapshotCell.hpp"
 #include "ThreadFactory.hpp"
+#include "TimingWheel.hpp"
+#include "WorkerPool.hpp"
 
 namespace ChordStatus {
     enum status {
@@ -28,34 +41,210 @@ namespace ChordStatus {
     };
 };
 
+namespace ChordTimer {
+    enum type {
+        STABILIZE,
+        FIX_FINGERS,
+        RESEND,             // id is the ID of the sendTimers entry
+        LOOKUP_RESEND,      // id is the requestId of the lookup
+        LOOKUP_DEADLINE,    // id is the requestId of the lookup
+        PACE,               // Deferred sends are due
+        PROBE_CHECK         // Peers probed by the last round should have answered
+    };
+};
+
+namespace ChordLookup {
+    enum mode {
+        DEFAULT,            // Whatever setLookupMode() selected
+        RECURSIVE,          // Each hop forwards the query to the next one
+        ITERATIVE           // The originator asks each hop for the next one itself
+    };
+};
 
-// How long to wait before resend
+
+// How long to wait before resending, until round trip times are measured
 const unsigned int SEND_TIMEOUT = 1500000;  // 1.5 seconds
+// Bounds of the retransmission timeout, whether measured or backed off
+const unsigned int MIN_RTO = 100000;    // 100 ms
+const unsigned int MAX_RTO = 12000000;  // 12 seconds
+// How many times a message or a recursive lookup is resent before it is given up on
+const unsigned int MAX_RETRANSMITS = 6;
 // How long between stabilizing
 const unsigned int PERIODIC_JOBS_TIMEOUT = 1500000;  // 1.5 seconds
 // How many times to try to join
 const unsigned int JOIN_TRIALS = 5;
+// Resolution of the timing wheel
+const unsigned int WHEEL_TICK = 10000;  // 10 ms
+// How many epoll events to handle per wakeup
+const int MAX_EVENTS = 16;
+// How many datagrams to receive or send per system call
+const unsigned int IO_BATCH = 32;
+// Largest datagram the service sends or accepts
+const size_t MAX_DATAGRAM = 1024;
+// How long a cached key location is trusted
+const unsigned int LOCATION_TTL = 10000000;  // 10 seconds
+// How many key ranges the location cache holds
+const unsigned int LOCATION_CACHE_SIZE = 1024;
+// How long a resolved host name is trusted
+const unsigned int NAME_TTL = 300000000;  // 5 minutes
+// How many host names the name resolver holds
+const unsigned int NAME_CACHE_SIZE = 1024;
+// How many keys are hashed per KeyHasher call
+const unsigned int HASH_BATCH = 256;
+// How many successors each node keeps track of
+const unsigned int SUCCESSOR_LIST_SIZE = 4;
+// How long to wait for the successor to answer a stabilize request
+const unsigned int SUCCESSOR_TIMEOUT = 500000;  // 500 ms
+// How many stabilize requests may go unanswered before the successor is given up on
+const unsigned int STABILIZE_RETRIES = 1;
+// Bounds of the stabilize interval: it starts short after a change around this node and doubles while nothing changes
+const unsigned int MIN_STABILIZE_INTERVAL = 250000;  // 250 ms
+const unsigned int MAX_STABILIZE_INTERVAL = 2 * PERIODIC_JOBS_TIMEOUT;  // 3 seconds
+// How long the predecessor may go without stabilizing before it is given up on;
+// covers its longest interval and a retried request
+const unsigned int PREDECESSOR_TIMEOUT = 3 * PERIODIC_JOBS_TIMEOUT;  // 4.5 seconds
+// How long a round trip time sample vouches for a peer being alive and near
+const unsigned int RTT_TTL = 8 * PERIODIC_JOBS_TIMEOUT;  // 12 seconds
+// How many peers are probed for their round trip time per finger refresh, besides those I route by
+const unsigned int PROBES_PER_ROUND = 16;
+// How many times a peer that did not answer a probe is probed again before it is given up on
+const unsigned int PROBE_RETRIES = 1;
+// How many fingers are looked up per finger refresh; the others wait for their turn
+const unsigned int FINGER_QUERIES_PER_ROUND = 2;
+// How many datagrams a peer may be sent per round trip, and at once
+const unsigned int PEER_WINDOW = 64;
+// How many datagrams a peer may be sent per second at most, however short its round trip
+const unsigned int PEER_RATE = 20000;
+// How many datagrams to a peer may wait for its window before new ones are dropped
+const unsigned int PEER_QUEUE_LIMIT = 1024;
+// How many datagrams may wait for room in the socket's send buffer before new ones are dropped
+const unsigned int BLOCKED_SEND_LIMIT = 4096;
+// How long an iterative lookup waits for a hop before resending to it, until its round trip time is measured
+const unsigned int HOP_TIMEOUT = 300000;  // 300 ms
+// How many times an iterative lookup resends to a silent hop before giving up
+const unsigned int HOP_RETRIES = 2;
+// How many hops an iterative lookup may take
+const unsigned int MAX_LOOKUP_HOPS = 2 * CHORD_LENGTH_BIT;
+// How many threads process received messages, unless set by setWorkerThreads()
+const unsigned int DEFAULT_WORKER_THREADS = 2;
 
 using namespace std;
 
 typedef struct {
     char *ipaddr;
-    char *hostname;
     unsigned int hashedId;
     bool isSelf;
     
-    int sfd;
+    // Updated when the peer comes back with another application port; read and written atomically
     unsigned int appPort;
     struct sockaddr *addr;
     socklen_t len;
+    
+    // Smoothed round trip time, its mean deviation and the lowest one seen in microseconds,
+    // 0 until measured; read and written atomically
+    uint32_t srtt, rttvar, rttMin;
+    // When the round trip time was last sampled, in TimingWheel::now() time; 0 if never or the node failed
+    uint64_t rttSeen;
+    // Set when the node stopped responding and cleared when it answers a request again, so
+    // others' stale routing state does not bring it back; read and written atomically
+    bool failed;
+    
+    // Send pacing: when the token bucket is full again, in TimingWheel::now() time, and how many
+    // datagrams wait for it in deferredSends. Read and written atomically
+    uint64_t paceFull;
+    unsigned int deferred;
+    
+    // Storage the pointers above point into, so a node is a single pool object
+    char ipbuf[INET6_ADDRSTRLEN];
+    struct sockaddr_storage addrbuf;
 } node;
 
+/**
+ * Everything a lookup is routed by. Published as a whole and never modified
+ * once published; see SnapshotCell
+ */
+typedef struct {
+    // successors[0] is the successor; the others take over in order if it fails
+    node *successors[SUCCESSOR_LIST_SIZE];
+    unsigned int successorCount;
+    node *predecessor;
+    // Finger i is a node in [fingerStart[i], fingerStart[i + 1]) if there is one, preferably the
+    // nearest by RTT, otherwise the successor of fingerStart[i]; NULL until known
+    node *fingers[CHORD_LENGTH_BIT];
+} routingTable;
+
+typedef struct {
+    size_t len;
+    unsigned char data[MAX_DATAGRAM];
+} datagram;
+
+/**
+ * Called exactly once for every accepted queryAsync(), when the lookup completes.
+ * Runs on a Chord worker thread (or on the caller's thread if the key resolved
+ * locally), so it should return quickly and must not call query()
+ * 
+ * @param   keyhash     The hash of the key that was looked up
+ * @param   hostip      IP address of the node responsible for the key; NULL if the
+ *                      lookup timed out or the service stopped. Only valid during the call
+ * @param   port        Application port of that node; 0 on failure
+ * @param   context     The context passed to queryAsync()
+ */
+typedef void (*QueryCallback)(uint32_t keyhash, const char *hostip, unsigned int port, void *context);
+
 typedef struct {
-    uint32_t timestamp;
+    char *key;
+    char *hostip;           // NULL if the lookup failed
+    unsigned int port;
+} QueryResult;
+
+/**
+ * An in-flight lookup, correlated with its response by requestId. Holds its
+ * own retransmit state, so lookups of the same key never interfere
+ */
+typedef struct {
+    uint32_t requestId;
+    uint32_t keyhash;
+    QueryCallback callback;
+    void *context;
+    
+    node *recipient;
+    datagram query;
+    bool iterative;
+    unsigned int hops;      // Hops asked so far, iterative lookups only
+    unsigned int retries;   // Resends to the current hop if iterative, of the whole lookup if recursive
+    uint64_t sentAt;        // When the query last went out, in TimingWheel::now() time
+    wheelTimer resend;
+    wheelTimer deadline;    // Not armed if the lookup has no timeout
+} pendingQuery;
+
+typedef struct {
+    wheelTimer timer;
     node *recipient;
-    unsigned char *context;
+    unsigned int retries;
+    uint64_t sentAt;        // When the message first went out, in TimingWheel::now() time
+    unsigned char context[MAX_DATAGRAM];
 } msgTimer;
 
+/**
+ * A datagram the socket had no room for, copied to be sent once it is writable again
+ */
+typedef struct {
+    struct sockaddr *addr;  // The recipient node's address
+    socklen_t len;
+    datagram *dg;
+} blockedSend;
+
+/**
+ * Running totals since the service was created, for monitoring
+ */
+typedef struct {
+    uint64_t retransmits;           // Messages and lookups sent again after a timeout
+    uint64_t retransmitFailures;    // Messages and lookups given up on after their last resend
+    uint64_t sendsDeferred;         // Datagrams held back until the peer's window opened
+    uint64_t sendsDropped;          // Datagrams dropped because too many were held back for the peer or the socket
+    uint64_t sendsBlocked;          // Datagrams the socket's send buffer had no room for, sent once it drained
+} ChordCounters;
+
 /**
  * ChordNotification class
  * 
@@ -93,8 +282,9 @@ protected:
  * @extends ChordError              The error wrapper for this chord service
  * @extends ServiceNotification     Base class for notification service abstraction
  * @extends ThreadFactory           For object oriented threading environment using pthread
+ * @extends WorkerPool              For dispatching received messages to worker threads
  */
-class Chord : public ChordError, public ServiceNotification, public ThreadFactory {
+class Chord : public ChordError, public ServiceNotification, public ThreadFactory, public WorkerPool {
 public:
     Chord(unsigned int appPort, unsigned int chordPort, char *ipaddr = NULL);
     ~Chord();
@@ -103,14 +293,23 @@ public:
     bool start();
     void stop();
     
-    char *query(char *key, char **hostip, unsigned int &port, unsigned int timeout = 0);
+    char *query(char *key, char **hostip, unsigned int &port, unsigned int timeout = 0,
+            ChordLookup::mode mode = ChordLookup::DEFAULT);
+    bool queryAsync(char *key, QueryCallback callback, void *context = NULL, unsigned int timeout = 0,
+            ChordLookup::mode mode = ChordLookup::DEFAULT);
+    vector<QueryResult> queryBatch(const vector<char *> &keys, unsigned int timeout = 0,
+            ChordLookup::mode mode = ChordLookup::DEFAULT);
     char *getChordMap();
     char *getFingerTable();
     unsigned int getHashedKey(char *key);
+    vector<unsigned int> getHashedKeys(const vector<char *> &keys);
     
     void setJoinPointIp(char *toJoin);
+    void setWorkerThreads(unsigned int count);
+    void setLookupMode(ChordLookup::mode mode);
     
     ChordStatus::status getState();
+    ChordCounters getCounters();
     
     /**
      * Implements the parent function
@@ -120,49 +319,168 @@ public:
     ChordNotification *popNotification() { return (ChordNotification *) ServiceNotification::popNotification(); }
     
 private:
-    pthread_mutex_t successorResponseQueueMutex, sendTimerMutex, chordMapResponseQueueMutex, fingerMutex;
+    // Times getSuccessorOf() on a routing table built offline
+    friend class RoutingBench;
+    
+    pthread_mutex_t pendingQueryMutex, sendTimerMutex, chordMapResponseQueueMutex, paceMutex, blockedSendMutex;
+    // Guards peers
+    pthread_rwlock_t peerLock;
 
-    ChordStatus::status state, substate;
+    ChordStatus::status state;
+    // STABILIZING while a stabilize request is unanswered; accessed atomically
+    ChordStatus::status substate;
     unsigned int hashedId;
     unsigned int appPort, chordPort;
-    unsigned int lastStabilizedTimestamp;
-    unsigned int lastFingerUpdateTimestamp;
+    unsigned int workerThreads;
+    ChordLookup::mode lookupMode;
     int chord_sfd;
+    // Whether the receiver thread was started, and so has to be joined
+    bool receiving;
+    EventLoop reactor;
+    // Every retransmission, lookup deadline and periodic job; the reactor blocks until the next one
+    TimingWheel timers;
+    wheelTimer stabilizeTimer, fingerTimer, paceTimer, probeTimer;
+    // Stabilize requests the successor left unanswered in a row; accessed atomically
+    unsigned int stabilizeMisses;
+    // ID of the stabilize request in flight, 0 if none, and the successor it went to. Set by
+    // the receiver thread, claimed by the worker that handles the answer; accessed atomically
+    uint32_t stabilizeRequestId;
+    node *stabilizeTarget;
+    // Last stabilize request ID given out; receiver thread only
+    uint32_t stabilizeSeq;
+    // Time to the next stabilize round while the successor answers; accessed atomically
+    unsigned int stabilizeInterval;
+    // When the predecessor last stabilized with me, in TimingWheel::now() time
+    uint64_t predecessorSeen;
+    // When the predecessor was probed because a node behind it notified me; 0 if it is not suspected
+    uint64_t predecessorProbed;
+    // Filled by the receiver thread only
+    vector<expiredTimer> expiredTimers;
+    // Preallocated batches, only used by the receiver thread
+    RecvBatch inbox;
+    SendBatch outbox;
+    // Pool buffers attached to the inbox slots; handed off to workers as received
+    datagram *inboxSlots[IO_BATCH];
+    // Owners of recently resolved key ranges
+    LocationCache locations;
+    // Host names of peers, for display only
+    NameResolver names;
+    
+    /*
+     * Pools for everything allocated while servicing. Datagrams are owned by the
+     * receiver until submitted, then by the worker processing them. Timers are owned
+     * by sendTimers. Nodes are interned in peers and may be in use by any thread,
+     * so they are only reclaimed when the pool is destroyed
+     */
+    ObjectPool<datagram> datagramPool;
+    ObjectPool<node> nodePool;
+    ObjectPool<msgTimer> timerPool;
+    ObjectPool<pendingQuery> queryPool;
+    node *selfNode;
     
     char *ipaddr, *hostname, *joinPointIp;
-    node *successor, *predecessor;
-    map<uint32_t, node *> fingers;
+    // Every node this one has talked to, by IP address; each is created once
+    map<string, node *> peers;
+    // Successor, predecessor and fingers; lookups read it without locking
+    SnapshotCell<routingTable> routing;
+    uint32_t fingerStart[CHORD_LENGTH_BIT];
+    // Per finger interval [fingerStart[i], fingerStart[i + 1]), the live peer with the lowest RTT;
+    // NULL if none is known. Written by the receiver thread, read atomically
+    node *nearest[CHORD_LENGTH_BIT];
+    // Where the next round of probes starts in peers; receiver thread only
+    string probeCursor;
+    // Peers the last round of probes went to, when and how many times they were probed again
+    // for not answering; receiver thread only
+    vector<node *> probed;
+    uint64_t probedAt;
+    unsigned int probeRetries;
+    // The finger the next finger refresh looks up first; receiver thread only
+    unsigned int fingerCursor;
+    // Where the next routing hints start among the peers I route by; accessed atomically
+    unsigned int hintCursor;
     
     map<uint32_t, msgTimer *> sendTimers;
-    vector<SuccessorResponse *> successorResponseQueue;
+    // Lookups waiting for a SuccessorResponse, by request ID
+    unordered_map<uint32_t, pendingQuery *> pendingQueries;
+    uint32_t nextRequestId;
+    // Datagrams waiting for their recipient's window, oldest first; guarded by paceMutex.
+    // paceArmed is whether paceTimer is set to drain them
+    map<node *, deque<datagram *> > deferredSends;
+    bool paceArmed;
+    // Datagrams waiting for room in the socket's send buffer, oldest first; guarded by
+    // blockedSendMutex. writeWatched is whether the reactor reports the socket writable
+    deque<blockedSend> blockedSends;
+    bool writeWatched;
+    // Round trip time of recursive lookups, from sending to the answer; guarded by pendingQueryMutex
+    uint32_t lookupSrtt, lookupRttvar;
+    // Updated atomically
+    ChordCounters counters;
     vector<ChordMapResponse *> chordMapResponseQueue;
     
     bool join();
     void notifySuccessor();
     
-    void processPeriodicJobs();
+    void armTimer(wheelTimer *t, unsigned int delay);
+    void processTimers();
+    void fixFingers();
+    void requestFingerTable(node *n);
+    void adoptFingers(const vector<node *> &candidates);
+    void addHints(RoutingHints &hints, uint32_t &size, node *recipient);
+    void takeHints(const MessageView &msg, size_t at);
+    void probePeers();
+    void checkProbes();
+    void sampleRtt(node *n, uint32_t sample);
+    unsigned int getRto(node *n, unsigned int initial, unsigned int retries);
     void threadWorker();
+    void handleMessage(const unsigned char *data, size_t len);
+    void processWork(void *job);
     void stabilize();
+    void tightenStabilize();
     
     unsigned int getHashedId();
     
-    node *createNode(char *ipaddr = NULL);
+    node *createNode(const char *ipaddr = NULL);
+    node *getPeer(const char *ipaddr, unsigned int appPort = 0);
+    string getDisplayName(const char *ipaddr);
     node *getSuccessor();
+    node *getPredecessor();
+    void setSuccessor(node *n);
+    void setPredecessor(node *n);
+    bool setSuccessors(const vector<node *> &successors);
+    bool acceptPredecessor(node *n);
+    void failPeer(node *n);
+    node *getFinger(unsigned int i);
+    void setFingers(uint64_t which, node *n);
     
     void *receiveMessage(int &size, unsigned int timeout = 0);
     size_t send(node *n, unsigned char *data, size_t len, int flag = 0);
+    void queueSend(node *n, unsigned char *data, size_t len);
+    int flushSends();
+    bool admitSend(node *n, unsigned char *data, size_t len);
+    bool takeToken(node *n);
+    void drainDeferredSends();
+    int flushBatch(SendBatch &batch);
+    void blockSend(struct sockaddr *addr, socklen_t addrlen, unsigned char *data, size_t len);
+    void drainBlockedSends();
     
-    void pushSuccessorResponse(SuccessorResponse *sr);
-    SuccessorResponse *popSuccessorResponse();
+    void flushQueries(SendBatch &pipeline, vector<datagram *> &encoded);
+    node *startQuery(uint32_t keyhash, QueryCallback callback, void *context, unsigned int timeout, datagram *query,
+            ChordLookup::mode mode);
+    void completeQuery(uint32_t requestId, const char *hostip, unsigned int port);
+    void advanceQuery(uint32_t requestId, const char *hostip, unsigned int port);
+    void expireQuery(uint32_t requestId);
+    void expireQueries();
     void pushChordMapResponse(ChordMapResponse *cmr);
     ChordMapResponse *popChordMapResponse();
     
     void pushSendTimer(node *sendTo, uint32_t searchTerm, unsigned char *data, size_t len);
     void unsetSendTimer(uint32_t searchTerm);
     
-    unsigned int getConsistentHash(char *, size_t len);
+    unsigned int getConsistentHash(const char *, size_t len);
+    void getConsistentHashes(const char **tohash, const size_t *lens, unsigned int count, uint32_t *ids);
     bool isInSuccessor(uint32_t key, uint32_t start = 0, uint32_t end = 0);
     node *getSuccessorOf(uint32_t key, bool useFinger = true);
+    int getFingerIndex(uint32_t searchTerm);
 };
 
 #endif
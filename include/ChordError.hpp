@@ -11,6 +11,7 @@ const unsigned int ERR_NOT_INITIALIZED = 6;
 const unsigned int ERR_NOT_IN_SERVICE = 7;
 const unsigned int ERR_NO_SUCCESSOR = 8;
 const unsigned int ERR_LOCAL_KEY = 9;
+const unsigned int ERR_QUERY_TIMEOUT = 10;
 
 /**
  * Chord errors wrapper, used for organizing error code and their explanatory strings
@@ -48,6 +49,8 @@ public:
                 return "No successor in chord ring";
             case ERR_LOCAL_KEY:
                 return "The key appears to be local";
+            case ERR_QUERY_TIMEOUT:
+                return "Query timed out";
             case NO_ERROR:
                 return "No error number was set";
             default:
@@ -0,0 +1,139 @@
+#ifndef __EVENT_LOOP_HPP__
+#define __EVENT_LOOP_HPP__
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/**
+ * For event driven I/O using epoll
+ *
+ * Watches any number of readable file descriptors, and for writability those
+ * the caller has something queued for, plus an eventfd that other threads can
+ * use to wake the loop up; timers are kept by the caller, which passes the time
+ * to the next one as the wait() timeout
+ */
+class EventLoop {
+public:
+    EventLoop() {
+        this->epfd = -1;
+        this->wakefd = -1;
+    }
+
+    virtual ~EventLoop() {
+        this->shutdown();
+    }
+
+    /**
+     * Creates the epoll instance and the wakeup eventfd
+     *
+     * @return  True if succeeded, false otherwise (errno is set)
+     */
+    bool open() {
+        this->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (this->epfd == -1) {
+            return false;
+        }
+
+        this->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (this->wakefd == -1) {
+            return false;
+        }
+
+        return this->watch(this->wakefd);
+    }
+
+    /**
+     * Closes the epoll instance and the wakeup eventfd
+     */
+    void shutdown() {
+        if (this->wakefd != -1) {
+            close(this->wakefd);
+            this->wakefd = -1;
+        }
+
+        if (this->epfd != -1) {
+            close(this->epfd);
+            this->epfd = -1;
+        }
+    }
+
+    /**
+     * Starts watching fd for readability (level triggered)
+     *
+     * @param   fd  The file descriptor to watch
+     * @return  True if succeeded, false otherwise (errno is set)
+     */
+    bool watch(int fd) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+
+        return epoll_ctl(this->epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+    }
+
+    /**
+     * Starts or stops also watching a watched fd for writability. Safe to call from any thread
+     *
+     * @param   fd          The file descriptor, already passed to watch()
+     * @param   writable    Whether to report it writable (level triggered)
+     * @return  True if succeeded, false otherwise (errno is set)
+     */
+    bool watchWritable(int fd, bool writable) {
+        struct epoll_event ev;
+        ev.events = writable ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+        ev.data.fd = fd;
+
+        return epoll_ctl(this->epfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+    }
+
+    /**
+     * Blocks until at least one watched descriptor is ready
+     *
+     * @param   events      Array to store the ready events in
+     * @param   max         Size of events
+     * @param   timeout     How long to wait for, in milliseconds. -1 blocks indefinitely
+     * @return  Number of ready events; -1 on error (errno is set)
+     */
+    int wait(struct epoll_event *events, int max, int timeout = -1) {
+        return epoll_wait(this->epfd, events, max, timeout);
+    }
+
+    /**
+     * Wakes up the thread blocked in wait(). Safe to call from any thread
+     */
+    void wakeup() {
+        uint64_t one = 1;
+        ssize_t ret = write(this->wakefd, &one, sizeof(one));
+        (void) ret;
+    }
+
+    /**
+     * Whether the ready descriptor is the wakeup eventfd
+     */
+    bool isWakeup(int fd) {
+        return fd == this->wakefd;
+    }
+
+    /**
+     * Reads and resets the counter of an eventfd
+     *
+     * @param   fd  The eventfd to read
+     * @return  Number of wakeups since the last read
+     */
+    static uint64_t drain(int fd) {
+        uint64_t count = 0;
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+            return 0;
+        }
+
+        return count;
+    }
+
+private:
+    int epfd, wakefd;
+};
+
+#endif
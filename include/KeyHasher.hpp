@@ -0,0 +1,29 @@
+#ifndef __KEY_HASHER_HPP__
+#define __KEY_HASHER_HPP__
+
+#include <cstddef>
+
+#include <openssl/sha.h>
+
+/**
+ * Computes SHA-1 digests of many keys per call
+ *
+ * Keys are hashed several at a time, one per SIMD lane (8 with AVX2, 4 with
+ * SSE2 or any other 128-bit vector unit); each lane moves on to the next key
+ * as soon as its current one is done, so keys of different lengths mix freely.
+ * Batches too small to fill the lanes, and keys longer than two blocks, where
+ * the lanes lose to it, go through OpenSSL one key at a time.
+ * The digests are identical to SHA1() in every case
+ */
+class KeyHasher {
+public:
+    static void sha1(const unsigned char **keys, const size_t *lens, unsigned int count,
+            unsigned char (*digests)[SHA_DIGEST_LENGTH]);
+    static void sha1Scalar(const unsigned char **keys, const size_t *lens, unsigned int count,
+            unsigned char (*digests)[SHA_DIGEST_LENGTH]);
+
+    static unsigned int getLanes();
+    static const char *getImplementation();
+};
+
+#endif
@@ -0,0 +1,220 @@
+#ifndef __LOCATION_CACHE_HPP__
+#define __LOCATION_CACHE_HPP__
+
+#include <cstring>
+#include <map>
+
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "TimingWheel.hpp"
+
+using namespace std;
+
+typedef struct {
+    uint32_t start;         // Exclusive; equal to end if the owner has the whole ring
+    uint64_t expires;       // In TimingWheel::now() time
+    unsigned int port;
+    char ipaddr[INET6_ADDRSTRLEN];
+} locationEntry;
+
+/**
+ * Remembers which node owns which part of the ring
+ *
+ * Each entry maps an ownership interval (start, end] of IDs, as reported by the
+ * node that resolved a lookup, to the owner's IP address and application port.
+ * Entries expire after a fixed time to live and can be invalidated early when an
+ * interval is known to have changed hands. Intervals may wrap around 0.
+ * Thread safe
+ */
+class LocationCache {
+public:
+    /**
+     * @param   ttl         How long an entry is trusted, in microseconds
+     * @param   capacity    Maximum number of entries
+     */
+    LocationCache(uint64_t ttl, unsigned int capacity) {
+        pthread_rwlock_init(&(this->cacheLock), NULL);
+        this->ttl = ttl;
+        this->capacity = capacity;
+    }
+
+    virtual ~LocationCache() {
+        pthread_rwlock_destroy(&(this->cacheLock));
+    }
+
+    /**
+     * Finds the owner of an ID
+     *
+     * @param   id      The ID to look up
+     * @param   ipaddr  Receives the IP address of the owner; at least INET6_ADDRSTRLEN bytes
+     * @param   port    Receives the application port of the owner
+     * @return  True if a live entry covers id, false otherwise
+     */
+    bool lookup(uint32_t id, char *ipaddr, unsigned int &port) {
+        uint64_t now = TimingWheel::now();
+        bool found = false;
+
+        pthread_rwlock_rdlock(&(this->cacheLock));
+        map<uint32_t, locationEntry>::iterator it = this->entries.lower_bound(id);
+        if (it == this->entries.end()) {
+            // Only an interval wrapping around 0 can still cover it
+            it = this->entries.begin();
+        }
+
+        if (it != this->entries.end() && it->second.expires > now
+                && LocationCache::covers(it->second.start, it->first, id)) {
+            strcpy(ipaddr, it->second.ipaddr);
+            port = it->second.port;
+            found = true;
+        }
+        pthread_rwlock_unlock(&(this->cacheLock));
+
+        return found;
+    }
+
+    /**
+     * Records that (start, end] is owned by the given node, replacing whatever
+     * overlapping intervals were known
+     *
+     * @param   start   Exclusive start of the interval, the owner's predecessor
+     * @param   end     Inclusive end of the interval, the owner's ID
+     * @param   ipaddr  IP address of the owner
+     * @param   port    Application port of the owner
+     */
+    void insert(uint32_t start, uint32_t end, const char *ipaddr, unsigned int port) {
+        if (ipaddr == NULL || strlen(ipaddr) >= INET6_ADDRSTRLEN) {
+            return;
+        }
+
+        locationEntry entry;
+        entry.start = start;
+        entry.expires = TimingWheel::now() + this->ttl;
+        entry.port = port;
+        strcpy(entry.ipaddr, ipaddr);
+
+        pthread_rwlock_wrlock(&(this->cacheLock));
+        this->erase(start, end);
+
+        if (this->entries.size() >= this->capacity) {
+            this->evict();
+        }
+
+        this->entries[end] = entry;
+        pthread_rwlock_unlock(&(this->cacheLock));
+    }
+
+    /**
+     * Drops every entry overlapping (start, end], e.g. because a node joined there
+     */
+    void invalidate(uint32_t start, uint32_t end) {
+        pthread_rwlock_wrlock(&(this->cacheLock));
+        this->erase(start, end);
+        pthread_rwlock_unlock(&(this->cacheLock));
+    }
+
+    /**
+     * Drops every entry owned by the given node, e.g. because it failed
+     */
+    void invalidateOwner(const char *ipaddr) {
+        pthread_rwlock_wrlock(&(this->cacheLock));
+        map<uint32_t, locationEntry>::iterator it = this->entries.begin();
+        while (it != this->entries.end()) {
+            if (strcmp(it->second.ipaddr, ipaddr) == 0) {
+                this->entries.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+        pthread_rwlock_unlock(&(this->cacheLock));
+    }
+
+    /**
+     * Drops every entry
+     */
+    void clear() {
+        pthread_rwlock_wrlock(&(this->cacheLock));
+        this->entries.clear();
+        pthread_rwlock_unlock(&(this->cacheLock));
+    }
+
+    unsigned int getSize() {
+        pthread_rwlock_rdlock(&(this->cacheLock));
+        unsigned int ret = this->entries.size();
+        pthread_rwlock_unlock(&(this->cacheLock));
+
+        return ret;
+    }
+
+private:
+    /**
+     * Whether id lies in (start, end] on the ring; start == end is the whole ring
+     */
+    static bool covers(uint32_t start, uint32_t end, uint32_t id) {
+        if (start < end) {
+            return id > start && id <= end;
+        }
+
+        return id > start || id <= end;
+    }
+
+    /**
+     * Whether (s1, e1] and (s2, e2] share any ID
+     */
+    static bool overlaps(uint32_t s1, uint32_t e1, uint32_t s2, uint32_t e2) {
+        return LocationCache::covers(s1, e1, e2) || LocationCache::covers(s2, e2, e1);
+    }
+
+    /**
+     * Removes the entries overlapping (start, end]. Caller holds the write lock
+     */
+    void erase(uint32_t start, uint32_t end) {
+        map<uint32_t, locationEntry>::iterator it = this->entries.begin();
+        while (it != this->entries.end()) {
+            if (LocationCache::overlaps(start, end, it->second.start, it->first)) {
+                this->entries.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    /**
+     * Makes room for one entry: drops the expired ones, or the one expiring first.
+     * Caller holds the write lock
+     */
+    void evict() {
+        uint64_t now = TimingWheel::now();
+
+        map<uint32_t, locationEntry>::iterator it = this->entries.begin();
+        while (it != this->entries.end()) {
+            if (it->second.expires <= now) {
+                this->entries.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+
+        if (this->entries.size() < this->capacity) {
+            return;
+        }
+
+        map<uint32_t, locationEntry>::iterator oldest = this->entries.begin();
+        for (it = this->entries.begin(); it != this->entries.end(); ++it) {
+            if (it->second.expires < oldest->second.expires) {
+                oldest = it;
+            }
+        }
+        this->entries.erase(oldest);
+    }
+
+    pthread_rwlock_t cacheLock;
+
+    uint64_t ttl;
+    unsigned int capacity;
+    // By end of interval
+    map<uint32_t, locationEntry> entries;
+};
+
+#endif
@@ -1,7 +1,10 @@
 #ifndef __MESSAGE_HANDLER_HPP__
 #define __MESSAGE_HANDLER_HPP__
 
+#include <cstddef>
+
 #include "MessageTypes.hpp"
+#include "MessageViews.hpp"
 
 /**
  * Processes and handles the messages specified in MessageTypes.hpp
@@ -11,7 +14,9 @@
 class MessageHandler {
 public:
     static unsigned char *serialize(void *msg);
+    static size_t encode(void *msg, unsigned char *buffer, size_t len);
     static void *unserialize(unsigned char *byteStream);
+    static bool validate(const unsigned char *byteStream, size_t len);
     
     static unsigned int getType(unsigned char *byteStream);
     static unsigned int getType(void *msg);
@@ -19,17 +24,33 @@ public:
     static unsigned int getSize(unsigned char *byteStream);
     static unsigned int getSize(void *msg);
 
-    static UpdatePredcessor *createUpdatePredecessor(uint32_t appPort, char *predecessor);
+    static UpdatePredcessor *createUpdatePredecessor(uint32_t appPort, const char *predecessor);
     static UpdatePredcessorAck *createUpdatePredecessorAck(uint32_t hashedId);
     
-    static StabilizeRequest *createStabilizeRequest(uint32_t appPort, char *sender);
-    static StabilizeResponse *createStabilizeResponse(uint32_t appPort, char *predecessor);
+    static StabilizeRequest *createStabilizeRequest(uint32_t appPort, const char *sender, uint32_t requestId = 0);
+    static StabilizeResponse *createStabilizeResponse(uint32_t appPort, const char *predecessor, uint32_t requestId = 0);
+    
+    static SuccessorQuery *createSuccessorQuery(uint32_t searchTerm, uint32_t appPort, const char *sender, uint32_t requestId = 0);
+    static SuccessorResponse *createSuccessorResponse(uint32_t searchTerm, uint32_t appPort, const char *responder,
+            uint32_t requestId = 0, uint32_t rangeStart = 0);
     
-    static SuccessorQuery *createSuccessorQuery(uint32_t searchTerm, uint32_t appPort, char *sender);
-    static SuccessorResponse *createSuccessorResponse(uint32_t searchTerm, uint32_t appPort, char *responder);
+    static ChordMapQuery *createChordMapQuery(uint32_t seq, const char *sender);
+    static ChordMapResponse *createChordMapResponse(uint32_t seq, const char *responder);
     
-    static ChordMapQuery *createChordMapQuery(uint32_t seq, char *sender);
-    static ChordMapResponse *createChordMapResponse(uint32_t seq, char *responder);
+    static UpdatePredcessor makeUpdatePredecessor(uint32_t appPort, const char *predecessor);
+    static StabilizeRequest makeStabilizeRequest(uint32_t appPort, const char *sender, uint32_t requestId = 0);
+    static SuccessorQuery makeSuccessorQuery(uint32_t searchTerm, uint32_t appPort, const char *sender, uint32_t requestId = 0);
+    static SuccessorResponse makeSuccessorResponse(uint32_t searchTerm, uint32_t appPort, const char *responder,
+            uint32_t requestId = 0, uint32_t rangeStart = 0);
+    static StabilizeResponse makeStabilizeResponse(uint32_t appPort, const char *predecessor, uint32_t requestId = 0);
+    static bool addSuccessor(StabilizeResponse &stres, uint32_t appPort, const char *ipaddr);
+    static bool addHint(RoutingHints &hints, uint32_t &size, uint32_t appPort, const char *ipaddr);
+    static FingerTableResponse makeFingerTableResponse(uint32_t appPort, const char *responder);
+    static bool addFingerEntry(FingerTableResponse &ftres, uint32_t appPort, const char *ipaddr);
+    static UpdatePredcessorAck makeUpdatePredecessorAck(uint32_t hashedId);
+    static Probe makeProbe(uint32_t stamp, uint32_t appPort, const char *sender);
+    static ChordMapQuery makeChordMapQuery(uint32_t seq, const char *sender);
+    static ChordMapResponse makeChordMapResponse(uint32_t seq, const char *responder);
 };
 
 #endif
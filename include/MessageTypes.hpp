@@ -14,6 +14,23 @@ const uint32_t MTYPE_STABILIZE_REQUEST = 8;
 const uint32_t MTYPE_STABILIZE_RESPONSE = 9;
 const uint32_t MTYPE_FINGER_QUERY = 10;
 const uint32_t MTYPE_FINGER_RESPONSE = 11;
+const uint32_t MTYPE_NEXT_HOP_QUERY = 12;
+const uint32_t MTYPE_NEXT_HOP_RESPONSE = 13;
+const uint32_t MTYPE_PROBE = 14;
+const uint32_t MTYPE_PROBE_ACK = 15;
+const uint32_t MTYPE_FINGER_TABLE_REQUEST = 16;
+const uint32_t MTYPE_FINGER_TABLE_RESPONSE = 17;
+
+// Most successors a StabilizeResponse carries
+const uint32_t MAX_SUCCESSORS = 8;
+// Bytes reserved for the IP address of each of them, NUL included
+const uint32_t SUCCESSOR_IP_LEN = 48;
+// Most nodes a FingerTableResponse carries; a longer table takes several responses
+const uint32_t MAX_FINGER_ENTRIES = 16;
+// Most peers the routing hints of a message carry
+const uint32_t MAX_HINTS = 4;
+// Set in RoutingHints::flags if the sender's successor has held for a while, so its range can be cached
+const uint32_t HINT_SETTLED_SUCCESSOR = 1;
 
 /**
  * Base message type (wrapper)
@@ -23,6 +40,24 @@ typedef struct {
     uint32_t size;
 } BaseMessage;
 
+typedef struct {
+    uint32_t appPort;
+    char ipaddr[SUCCESSOR_IP_LEN];
+} SuccessorEntry;
+
+/**
+ * Optional trailer of UpdatePredcessorAck, StabilizeResponse and SuccessorResponse:
+ * peers the sender knows, its successor first. On the wire it follows the last
+ * field, and is left out if count is 0; receivers that do not read it stop at
+ * the end of the string before it
+ */
+typedef struct {
+    uint32_t count;
+    uint32_t flags;
+    uint32_t senderId;      // Hashed ID of the sender, so the successor's range is (senderId, entries[0]]
+    SuccessorEntry entries[MAX_HINTS];
+} RoutingHints;
+
 typedef struct {
     uint32_t type;
     uint32_t size;
@@ -35,11 +70,17 @@ typedef struct {
     uint32_t type;
     uint32_t size;
     uint32_t hashedId;
+    RoutingHints hints;
 } UpdatePredcessorAck;
 
+/**
+ * Also used for MTYPE_FINGER_TABLE_REQUEST, which asks the recipient for the
+ * nodes in its finger table and successor list
+ */
 typedef struct {
     uint32_t type;
     uint32_t size;
+    uint32_t requestId; // Echoed in the response; 0 if the sender does not correlate
     
     uint32_t appPort;
     char *sender;
@@ -48,29 +89,68 @@ typedef struct {
 typedef struct {
     uint32_t type;
     uint32_t size;
+    uint32_t requestId; // Copied from the request being answered
     
     uint32_t appPort;
+    uint32_t successorCount;
+    SuccessorEntry successors[MAX_SUCCESSORS];  // The responder's successor list, nearest first
     char *predecessor;
+    RoutingHints hints;
 } StabilizeResponse;
 
+typedef struct {
+    uint32_t type;
+    uint32_t size;
+    
+    uint32_t appPort;
+    uint32_t entryCount;
+    SuccessorEntry entries[MAX_FINGER_ENTRIES];    // Distinct nodes the responder routes by, in no order
+    char *responder;
+} FingerTableResponse;
+
+/**
+ * Also used for MTYPE_NEXT_HOP_QUERY, which asks the recipient for the owner of
+ * searchTerm if it knows it, and for its closest preceding finger otherwise
+ */
 typedef struct {
     uint32_t type;
     uint32_t size;
     uint32_t searchTerm;
+    uint32_t requestId; // Echoed in the response; 0 if the sender does not correlate
     
     uint32_t appPort;
     char *sender;   // IP addr of the sender
 } SuccessorQuery;
 
+/**
+ * Also used for MTYPE_NEXT_HOP_RESPONSE, where responder is the next node to ask
+ * and rangeStart is unused
+ */
 typedef struct {
     uint32_t type;
     uint32_t size;
     uint32_t searchTerm;
+    uint32_t requestId; // Copied from the query being answered
+    uint32_t rangeStart;    // ID of the responder's predecessor, as known by whoever answered;
+                            // the responder's own ID if unknown, and then no range is cached
 
     uint32_t appPort;
     char *responder;    // IP addr of the responder
+    RoutingHints hints;
 } SuccessorResponse;
 
+/**
+ * Also used for MTYPE_PROBE_ACK, which echoes stamp back with the responder as sender
+ */
+typedef struct {
+    uint32_t type;
+    uint32_t size;
+    uint32_t stamp;     // Low bits of the prober's clock in microseconds, when sent
+    
+    uint32_t appPort;
+    char *sender;
+} Probe;
+
 typedef struct {
     uint32_t type;
     uint32_t size;
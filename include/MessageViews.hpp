@@ -0,0 +1,205 @@
+#ifndef __MESSAGE_VIEWS_HPP__
+#define __MESSAGE_VIEWS_HPP__
+
+#include <cstring>
+
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include "MessageTypes.hpp"
+
+/**
+ * Read-only, bounds-checked view over a serialized message
+ *
+ * Views decode fields straight from the receive buffer instead of copying them
+ * into a message struct, so the buffer must outlive the view. Accessors never
+ * read past the received length: out of range numbers read as 0 and strings that
+ * are missing or not NUL-terminated within the message read as NULL
+ */
+class MessageView {
+public:
+    MessageView(const unsigned char *data, size_t len) {
+        this->data = data;
+        this->len = len;
+    }
+
+    uint32_t getType() const { return this->field(0); }
+    uint32_t getSize() const { return this->field(4); }
+
+    const unsigned char *bytes() const { return this->data; }
+    size_t length() const { return this->len; }
+
+    /**
+     * Routing hints starting at offset at, as returned by the hints() of a view;
+     * count reads as 0 if there are none or they do not fit in the message
+     */
+    uint32_t hintCount(size_t at) const {
+        uint32_t count = (at == 0) ? 0 : this->field(at);
+        size_t end = this->getSize() < this->len ? this->getSize() : this->len;
+        return (count > MAX_HINTS || at + 12 + count * HINT_ENTRY > end) ? 0 : count;
+    }
+    uint32_t hintFlags(size_t at) const { return this->field(at + 4); }
+    uint32_t hintSender(size_t at) const { return this->field(at + 8); }
+    uint32_t hintPort(size_t at, uint32_t i) const { return this->field(at + 12 + i * HINT_ENTRY); }
+    const char *hintIp(size_t at, uint32_t i) const {
+        const char *ip = this->string(at + 16 + i * HINT_ENTRY);
+        return (ip != NULL && memchr(ip, '\0', SUCCESSOR_IP_LEN) != NULL) ? ip : NULL;
+    }
+
+    static const size_t HINT_ENTRY = 4 + SUCCESSOR_IP_LEN;
+
+protected:
+    /**
+     * Reads the 4-byte network order integer at offset
+     */
+    uint32_t field(size_t offset) const {
+        if (offset + 4 > this->len) {
+            return 0;
+        }
+
+        uint32_t val;
+        memcpy(&val, this->data + offset, 4);
+        return ntohl(val);
+    }
+
+    /**
+     * Returns the NUL-terminated string starting at offset, NULL if it does not end within the message
+     */
+    const char *string(size_t offset) const {
+        size_t end = this->getSize();
+        if (end > this->len) {
+            end = this->len;
+        }
+
+        if (offset >= end || memchr(this->data + offset, '\0', end - offset) == NULL) {
+            return NULL;
+        }
+
+        return (const char *) (this->data + offset);
+    }
+
+    /**
+     * Returns the offset just past the string starting at offset, 0 if there is none
+     */
+    size_t after(size_t offset) const {
+        const char *str = this->string(offset);
+        return (str != NULL) ? offset + strlen(str) + 1 : 0;
+    }
+
+    const unsigned char *data;
+    size_t len;
+};
+
+class UpdatePredecessorView : public MessageView {
+public:
+    UpdatePredecessorView(const unsigned char *data, size_t len) : MessageView(data, len) { }
+
+    uint32_t appPort() const { return this->field(8); }
+    const char *predecessor() const { return this->string(12); }
+};
+
+class UpdatePredecessorAckView : public MessageView {
+public:
+    UpdatePredecessorAckView(const unsigned char *data, size_t len) : MessageView(data, len) { }
+
+    uint32_t hashedId() const { return this->field(8); }
+    size_t hints() const { return 12; }
+};
+
+class StabilizeRequestView : public MessageView {
+public:
+    StabilizeRequestView(const unsigned char *data, size_t len) : MessageView(data, len) { }
+
+    uint32_t requestId() const { return this->field(8); }
+    uint32_t appPort() const { return this->field(12); }
+    const char *sender() const { return this->string(16); }
+};
+
+class StabilizeResponseView : public MessageView {
+public:
+    StabilizeResponseView(const unsigned char *data, size_t len) : MessageView(data, len) { }
+
+    uint32_t requestId() const { return this->field(8); }
+    uint32_t appPort() const { return this->field(12); }
+    uint32_t successorCount() const {
+        uint32_t count = this->field(16);
+        return count > MAX_SUCCESSORS ? 0 : count;
+    }
+    uint32_t successorPort(uint32_t i) const { return this->field(20 + i * ENTRY); }
+    const char *successorIp(uint32_t i) const {
+        const char *ip = this->string(24 + i * ENTRY);
+        return (ip != NULL && memchr(ip, '\0', SUCCESSOR_IP_LEN) != NULL) ? ip : NULL;
+    }
+    const char *predecessor() const { return this->string(20 + this->successorCount() * ENTRY); }
+    size_t hints() const { return this->after(20 + this->successorCount() * ENTRY); }
+
+    static const size_t ENTRY = 4 + SUCCESSOR_IP_LEN;
+};
+
+class FingerTableResponseView : public MessageView {
+public:
+    FingerTableResponseView(const unsigned char *data, size_t len) : MessageView(data, len) { }
+
+    uint32_t appPort() const { return this->field(8); }
+    uint32_t entryCount() const {
+        uint32_t count = this->field(12);
+        return count > MAX_FINGER_ENTRIES ? 0 : count;
+    }
+    uint32_t entryPort(uint32_t i) const { return this->field(16 + i * ENTRY); }
+    const char *entryIp(uint32_t i) const {
+        const char *ip = this->string(20 + i * ENTRY);
+        return (ip != NULL && memchr(ip, '\0', SUCCESSOR_IP_LEN) != NULL) ? ip : NULL;
+    }
+    const char *responder() const { return this->string(16 + this->entryCount() * ENTRY); }
+
+    static const size_t ENTRY = 4 + SUCCESSOR_IP_LEN;
+};
+
+class SuccessorQueryView : public MessageView {
+public:
+    SuccessorQueryView(const unsigned char *data, size_t len) : MessageView(data, len) { }
+
+    uint32_t searchTerm() const { return this->field(8); }
+    uint32_t requestId() const { return this->field(12); }
+    uint32_t appPort() const { return this->field(16); }
+    const char *sender() const { return this->string(20); }
+};
+
+class SuccessorResponseView : public MessageView {
+public:
+    SuccessorResponseView(const unsigned char *data, size_t len) : MessageView(data, len) { }
+
+    uint32_t searchTerm() const { return this->field(8); }
+    uint32_t requestId() const { return this->field(12); }
+    uint32_t rangeStart() const { return this->field(16); }
+    uint32_t appPort() const { return this->field(20); }
+    const char *responder() const { return this->string(24); }
+    size_t hints() const { return this->after(24); }
+};
+
+class ProbeView : public MessageView {
+public:
+    ProbeView(const unsigned char *data, size_t len) : MessageView(data, len) { }
+
+    uint32_t stamp() const { return this->field(8); }
+    uint32_t appPort() const { return this->field(12); }
+    const char *sender() const { return this->string(16); }
+};
+
+class ChordMapQueryView : public MessageView {
+public:
+    ChordMapQueryView(const unsigned char *data, size_t len) : MessageView(data, len) { }
+
+    uint32_t seq() const { return this->field(8); }
+    const char *sender() const { return this->string(12); }
+};
+
+class ChordMapResponseView : public MessageView {
+public:
+    ChordMapResponseView(const unsigned char *data, size_t len) : MessageView(data, len) { }
+
+    uint32_t seq() const { return this->field(8); }
+    const char *responder() const { return this->string(12); }
+};
+
+#endif
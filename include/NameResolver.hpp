@@ -0,0 +1,241 @@
+#ifndef __NAME_RESOLVER_HPP__
+#define __NAME_RESOLVER_HPP__
+
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+
+#include <stdint.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "TimingWheel.hpp"
+
+using namespace std;
+
+typedef struct {
+    string name;            // Empty if the address has no name
+    uint64_t expires;       // In TimingWheel::now() time
+    bool queued;
+} nameEntry;
+
+/**
+ * Resolves IP addresses to host names in the background
+ *
+ * Callers never wait on DNS: getName() answers from the cache and queues the
+ * address for the resolver thread when it is missing or expired, so a name
+ * shows up on a later call. Both names and failed lookups are cached for a
+ * fixed time to live. Only for display; nothing should route by these names.
+ * Thread safe
+ */
+class NameResolver {
+public:
+    /**
+     * @param   ttl         How long a name is trusted, in microseconds
+     * @param   capacity    Maximum number of cached addresses
+     */
+    NameResolver(uint64_t ttl, unsigned int capacity) {
+        pthread_mutex_init(&(this->nameLock), NULL);
+        pthread_cond_init(&(this->nameCond), NULL);
+        this->ttl = ttl;
+        this->capacity = capacity;
+        this->running = false;
+        this->stopping = false;
+    }
+
+    virtual ~NameResolver() {
+        this->stop();
+        pthread_cond_destroy(&(this->nameCond));
+        pthread_mutex_destroy(&(this->nameLock));
+    }
+
+    /**
+     * Starts the resolver thread. Addresses queued before are resolved then
+     *
+     * @return  True if the thread is running, false otherwise
+     */
+    bool start() {
+        pthread_mutex_lock(&(this->nameLock));
+        if (!this->running) {
+            this->stopping = false;
+            this->running = (pthread_create(&(this->resolver), NULL, startResolver, this) == 0);
+        }
+        bool ret = this->running;
+        pthread_mutex_unlock(&(this->nameLock));
+
+        return ret;
+    }
+
+    /**
+     * Stops and joins the resolver thread. Lookups in progress are finished first
+     */
+    void stop() {
+        pthread_mutex_lock(&(this->nameLock));
+        if (!this->running) {
+            pthread_mutex_unlock(&(this->nameLock));
+            return;
+        }
+
+        this->stopping = true;
+        pthread_cond_signal(&(this->nameCond));
+        pthread_mutex_unlock(&(this->nameLock));
+
+        pthread_join(this->resolver, NULL);
+
+        pthread_mutex_lock(&(this->nameLock));
+        this->running = false;
+        pthread_mutex_unlock(&(this->nameLock));
+    }
+
+    /**
+     * Queues an address to be resolved, unless its name is already known
+     *
+     * @param   ipaddr  The IP address, in numeric form
+     */
+    void prefetch(const char *ipaddr) {
+        string dummy;
+        this->getName(ipaddr, dummy);
+    }
+
+    /**
+     * Finds the host name of an address without blocking on DNS
+     *
+     * @param   ipaddr  The IP address, in numeric form
+     * @param   name    Receives the host name, if known
+     * @return  True if a name is known, false if not (yet)
+     */
+    bool getName(const char *ipaddr, string &name) {
+        if (ipaddr == NULL) {
+            return false;
+        }
+
+        uint64_t now = TimingWheel::now();
+        bool found = false;
+
+        pthread_mutex_lock(&(this->nameLock));
+        map<string, nameEntry>::iterator it = this->names.find(ipaddr);
+        if (it == this->names.end()) {
+            if (this->names.size() >= this->capacity) {
+                this->evict(now);
+            }
+
+            nameEntry entry;
+            entry.expires = 0;
+            entry.queued = false;
+            it = this->names.insert(make_pair(string(ipaddr), entry)).first;
+        }
+
+        if (!it->second.name.empty()) {
+            // Stale names are still better than none while they are refreshed
+            name = it->second.name;
+            found = true;
+        }
+
+        if (it->second.expires <= now && !it->second.queued) {
+            it->second.queued = true;
+            this->queue.push_back(it->first);
+            pthread_cond_signal(&(this->nameCond));
+        }
+        pthread_mutex_unlock(&(this->nameLock));
+
+        return found;
+    }
+
+private:
+    static void *startResolver(void *thisObj) {
+        ((NameResolver *) thisObj)->resolverLoop();
+        return NULL;
+    }
+
+    void resolverLoop() {
+        while (true) {
+            pthread_mutex_lock(&(this->nameLock));
+            while (this->queue.empty() && !this->stopping) {
+                pthread_cond_wait(&(this->nameCond), &(this->nameLock));
+            }
+
+            if (this->stopping) {
+                pthread_mutex_unlock(&(this->nameLock));
+                return;
+            }
+
+            string ipaddr = this->queue.front();
+            this->queue.pop_front();
+            pthread_mutex_unlock(&(this->nameLock));
+
+            string name = NameResolver::resolve(ipaddr.c_str());
+
+            pthread_mutex_lock(&(this->nameLock));
+            map<string, nameEntry>::iterator it = this->names.find(ipaddr);
+            if (it != this->names.end()) {
+                if (!name.empty() || it->second.name.empty()) {
+                    // Keep a name that was known if the lookup failed this time
+                    it->second.name = name;
+                }
+                it->second.expires = TimingWheel::now() + this->ttl;
+                it->second.queued = false;
+            }
+            pthread_mutex_unlock(&(this->nameLock));
+        }
+    }
+
+    /**
+     * Reverse lookup of one address; blocks for as long as DNS takes
+     *
+     * @return  The host name; empty if there is none
+     */
+    static string resolve(const char *ipaddr) {
+        struct sockaddr_in sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        if (inet_pton(AF_INET, ipaddr, &(sa.sin_addr)) != 1) {
+            return string();
+        }
+
+        char host[NI_MAXHOST];
+        if (getnameinfo((struct sockaddr *) &sa, sizeof(sa), host, sizeof(host), NULL, 0, NI_NAMEREQD) != 0) {
+            return string();
+        }
+
+        return string(host);
+    }
+
+    /**
+     * Makes room for one entry: drops the expired ones, or any one if none has.
+     * Queued entries are kept so the resolver finds them. Caller holds the lock
+     */
+    void evict(uint64_t now) {
+        map<string, nameEntry>::iterator it = this->names.begin();
+        while (it != this->names.end()) {
+            if (!it->second.queued && it->second.expires <= now) {
+                this->names.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+
+        for (it = this->names.begin(); it != this->names.end() && this->names.size() >= this->capacity; ) {
+            if (!it->second.queued) {
+                this->names.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    pthread_mutex_t nameLock;
+    pthread_cond_t nameCond;
+    pthread_t resolver;
+
+    uint64_t ttl;
+    unsigned int capacity;
+    bool running, stopping;
+    map<string, nameEntry> names;
+    // Addresses waiting for the resolver thread
+    deque<string> queue;
+};
+
+#endif
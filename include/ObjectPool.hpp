@@ -0,0 +1,247 @@
+#ifndef __OBJECT_POOL_HPP__
+#define __OBJECT_POOL_HPP__
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include <pthread.h>
+
+using namespace std;
+
+/**
+ * Slab allocator for fixed size objects (plain structs)
+ *
+ * Objects are carved out of slabs of slabSize objects; released objects go to a
+ * free list and are handed out again by acquire(), so once the pool has grown to
+ * the working set nothing is allocated any more. Slabs whose objects are all
+ * free again are returned to the system by trim(), and the rest when the pool
+ * is destroyed.
+ *
+ * Every thread keeps a small cache of free objects in front of the shared free
+ * list, so acquire() and release() only take the pool lock to move a batch of
+ * objects between the two. Objects released on another thread than they were
+ * acquired on, like received datagrams handed to the workers, flow back through
+ * the shared list. A thread's cache goes back to the shared list when it exits.
+ *
+ * Ownership: whoever acquire()s an object owns it until it is release()d, which
+ * may happen on any thread. Every object must be released at most once, and
+ * must not be used after the pool is destroyed
+ */
+template <class T>
+class ObjectPool {
+public:
+    ObjectPool(unsigned int slabSize = 64) {
+        pthread_mutex_init(&(this->poolLock), NULL);
+        pthread_key_create(&(this->cacheKey), flushCache);
+        this->slabSize = slabSize;
+        // Half a slab per refill or spill, so a thread that only acquires or only
+        // releases takes the lock once every batch objects
+        this->batch = max(slabSize / 2, 1U);
+    }
+
+    virtual ~ObjectPool() {
+        // No exiting thread flushes into the pool once the key is gone
+        pthread_key_delete(this->cacheKey);
+        for (unsigned int i = 0; i < this->caches.size(); ++i) {
+            delete this->caches[i];
+        }
+
+        for (unsigned int i = 0; i < this->slabs.size(); ++i) {
+            delete[] this->slabs[i];
+        }
+
+        pthread_mutex_destroy(&(this->poolLock));
+    }
+
+    /**
+     * Returns an object, growing the pool by a slab if none is free.
+     * The contents are left over from its previous use; the caller initializes it
+     */
+    T *acquire() {
+        threadCache *cache = this->getCache();
+        if (cache->objects.empty()) {
+            pthread_mutex_lock(&(this->poolLock));
+            if (this->freeList.size() < this->batch) {
+                this->grow();
+            }
+
+            cache->objects.insert(cache->objects.end(), this->freeList.end() - this->batch, this->freeList.end());
+            this->freeList.resize(this->freeList.size() - this->batch);
+            pthread_mutex_unlock(&(this->poolLock));
+        }
+
+        T *obj = cache->objects.back();
+        cache->objects.pop_back();
+        __atomic_store_n(&(cache->count), cache->objects.size(), __ATOMIC_RELAXED);
+
+        return obj;
+    }
+
+    /**
+     * Returns an object to the pool
+     */
+    void release(T *obj) {
+        if (obj == NULL) {
+            return;
+        }
+
+        threadCache *cache = this->getCache();
+        cache->objects.push_back(obj);
+        if (cache->objects.size() >= 2 * this->batch) {
+            // Keep a batch for this thread's next acquires, hand the rest to the others
+            pthread_mutex_lock(&(this->poolLock));
+            this->freeList.insert(this->freeList.end(), cache->objects.end() - this->batch, cache->objects.end());
+            pthread_mutex_unlock(&(this->poolLock));
+            cache->objects.resize(cache->objects.size() - this->batch);
+        }
+        __atomic_store_n(&(cache->count), cache->objects.size(), __ATOMIC_RELAXED);
+    }
+
+    /**
+     * Returns the slabs whose objects are all on the shared free list to the system,
+     * keeping one slab's worth of free objects for the next acquires
+     *
+     * @return  Number of slabs returned
+     */
+    unsigned int trim() {
+        pthread_mutex_lock(&(this->poolLock));
+        if (this->freeList.size() < 2 * this->slabSize) {
+            pthread_mutex_unlock(&(this->poolLock));
+            return 0;
+        }
+
+        // Count the free objects of each slab, finding slabs by address
+        vector<T *> sorted(this->slabs);
+        sort(sorted.begin(), sorted.end(), less<T *>());
+        vector<unsigned int> freeCount(sorted.size(), 0);
+        for (unsigned int i = 0; i < this->freeList.size(); ++i) {
+            typename vector<T *>::iterator it = upper_bound(sorted.begin(), sorted.end(), this->freeList[i], less<T *>());
+            ++freeCount[it - sorted.begin() - 1];
+        }
+
+        vector<T *> released;
+        unsigned int remaining = this->freeList.size();
+        for (unsigned int i = 0; i < sorted.size() && remaining >= 2 * this->slabSize; ++i) {
+            if (freeCount[i] == this->slabSize) {
+                released.push_back(sorted[i]);
+                remaining -= this->slabSize;
+            }
+        }
+
+        if (!released.empty()) {
+            // Both sorted by address, so membership is a binary search
+            vector<T *> kept;
+            kept.reserve(remaining);
+            for (unsigned int i = 0; i < this->freeList.size(); ++i) {
+                T *obj = this->freeList[i];
+                typename vector<T *>::iterator it = upper_bound(sorted.begin(), sorted.end(), obj, less<T *>());
+                if (!binary_search(released.begin(), released.end(), *(it - 1), less<T *>())) {
+                    kept.push_back(obj);
+                }
+            }
+            this->freeList.swap(kept);
+
+            for (unsigned int i = 0; i < released.size(); ++i) {
+                this->slabs.erase(find(this->slabs.begin(), this->slabs.end(), released[i]));
+                delete[] released[i];
+            }
+        }
+        pthread_mutex_unlock(&(this->poolLock));
+
+        return released.size();
+    }
+
+    /**
+     * Number of objects the pool has allocated in total
+     */
+    unsigned int getCapacity() {
+        pthread_mutex_lock(&(this->poolLock));
+        unsigned int ret = this->slabs.size() * this->slabSize;
+        pthread_mutex_unlock(&(this->poolLock));
+
+        return ret;
+    }
+
+    /**
+     * Number of objects currently acquired; approximate while other threads
+     * acquire or release objects
+     */
+    unsigned int getInUse() {
+        pthread_mutex_lock(&(this->poolLock));
+        unsigned int ret = this->slabs.size() * this->slabSize - this->freeList.size();
+        for (unsigned int i = 0; i < this->caches.size(); ++i) {
+            ret -= __atomic_load_n(&(this->caches[i]->count), __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&(this->poolLock));
+
+        return ret;
+    }
+
+private:
+    typedef struct {
+        ObjectPool<T> *pool;
+        // Only touched by the owning thread, except count which getInUse() reads
+        vector<T *> objects;
+        unsigned int count;
+    } threadCache;
+
+    /**
+     * The calling thread's cache, created on first use
+     */
+    threadCache *getCache() {
+        threadCache *cache = (threadCache *) pthread_getspecific(this->cacheKey);
+        if (cache == NULL) {
+            cache = new threadCache();
+            cache->pool = this;
+            cache->count = 0;
+            cache->objects.reserve(2 * this->batch);
+
+            pthread_mutex_lock(&(this->poolLock));
+            this->caches.push_back(cache);
+            pthread_mutex_unlock(&(this->poolLock));
+            pthread_setspecific(this->cacheKey, cache);
+        }
+
+        return cache;
+    }
+
+    /**
+     * Adds a slab to the shared free list. Called with poolLock held
+     */
+    void grow() {
+        T *slab = new T[this->slabSize];
+        this->slabs.push_back(slab);
+
+        for (unsigned int i = 0; i < this->slabSize; ++i) {
+            this->freeList.push_back(slab + i);
+        }
+    }
+
+    /**
+     * Destructor of cacheKey: hands the cache of an exiting thread back to its pool
+     */
+    static void flushCache(void *arg) {
+        threadCache *cache = (threadCache *) arg;
+        ObjectPool<T> *pool = cache->pool;
+
+        pthread_mutex_lock(&(pool->poolLock));
+        pool->freeList.insert(pool->freeList.end(), cache->objects.begin(), cache->objects.end());
+        pool->caches.erase(find(pool->caches.begin(), pool->caches.end(), cache));
+        pthread_mutex_unlock(&(pool->poolLock));
+
+        delete cache;
+    }
+
+    pthread_mutex_t poolLock;
+    pthread_key_t cacheKey;
+
+    unsigned int slabSize;
+    unsigned int batch;
+    vector<T *> slabs;
+    vector<T *> freeList;
+    // Every thread's cache, so the pool can free them and count what they hold
+    vector<threadCache *> caches;
+};
+
+#endif
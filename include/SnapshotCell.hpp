@@ -0,0 +1,116 @@
+#ifndef __SNAPSHOT_CELL_HPP__
+#define __SNAPSHOT_CELL_HPP__
+
+#include <pthread.h>
+#include <sched.h>
+
+/**
+ * Holds the current version of some state as an immutable snapshot (RCU style)
+ *
+ * Readers pin the current snapshot with one atomic load and never block; a
+ * Reader must only be held for as long as it takes to copy out what is needed.
+ * Writers are serialized: edit() hands out a private copy of the current
+ * snapshot, and publish() swaps it in and frees the old version once every
+ * reader that could still see it is done.
+ *
+ * Readers are counted in one of two epochs. publish() flips the epoch twice,
+ * each time waiting for the readers counted in the epoch it left, so it never
+ * waits for readers that started after the swap and cannot be starved by them
+ */
+template <class T>
+class SnapshotCell {
+public:
+    /**
+     * Pins the current snapshot for as long as it is in scope
+     */
+    class Reader {
+    public:
+        Reader(SnapshotCell<T> &cell) : cell(cell) {
+            this->slot = __atomic_load_n(&(cell.epoch), __ATOMIC_ACQUIRE) & 1;
+            __atomic_fetch_add(&(cell.readers[this->slot]), 1, __ATOMIC_SEQ_CST);
+            this->snapshot = __atomic_load_n(&(cell.current), __ATOMIC_SEQ_CST);
+        }
+
+        ~Reader() {
+            __atomic_fetch_sub(&(this->cell.readers[this->slot]), 1, __ATOMIC_RELEASE);
+        }
+
+        const T *operator->() const { return this->snapshot; }
+        const T &operator*() const { return *(this->snapshot); }
+
+    private:
+        Reader(const Reader &);
+        Reader &operator=(const Reader &);
+
+        SnapshotCell<T> &cell;
+        unsigned int slot;
+        const T *snapshot;
+    };
+
+    /**
+     * @param   initial     The first snapshot; the cell owns it
+     */
+    SnapshotCell(T *initial) {
+        pthread_mutex_init(&(this->writeLock), NULL);
+        this->current = initial;
+        this->epoch = 0;
+        this->readers[0] = this->readers[1] = 0;
+    }
+
+    virtual ~SnapshotCell() {
+        delete this->current;
+        pthread_mutex_destroy(&(this->writeLock));
+    }
+
+    /**
+     * Starts an update. Must be followed by publish() or discard() of the returned copy
+     *
+     * @return  A private copy of the current snapshot, to be modified freely
+     */
+    T *edit() {
+        pthread_mutex_lock(&(this->writeLock));
+        return new T(*(this->current));
+    }
+
+    /**
+     * Makes an edited copy the current snapshot. Returns once no reader can see
+     * the previous one, which is then freed
+     *
+     * @param   next    The copy returned by edit()
+     */
+    void publish(T *next) {
+        T *old = this->current;
+        __atomic_store_n(&(this->current), next, __ATOMIC_SEQ_CST);
+
+        for (int i = 0; i < 2; ++i) {
+            unsigned int left = __atomic_fetch_add(&(this->epoch), 1, __ATOMIC_SEQ_CST) & 1;
+            while (__atomic_load_n(&(this->readers[left]), __ATOMIC_ACQUIRE) != 0) {
+                sched_yield();
+            }
+        }
+
+        pthread_mutex_unlock(&(this->writeLock));
+        delete old;
+    }
+
+    /**
+     * Abandons an update, e.g. because nothing changed
+     *
+     * @param   next    The copy returned by edit()
+     */
+    void discard(T *next) {
+        pthread_mutex_unlock(&(this->writeLock));
+        delete next;
+    }
+
+private:
+    SnapshotCell(const SnapshotCell &);
+    SnapshotCell &operator=(const SnapshotCell &);
+
+    pthread_mutex_t writeLock;
+    T *current;
+    unsigned int epoch;
+    unsigned long readers[2];
+};
+
+#endif
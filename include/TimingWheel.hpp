@@ -0,0 +1,298 @@
+#ifndef __TIMING_WHEEL_HPP__
+#define __TIMING_WHEEL_HPP__
+
+#include <vector>
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+using namespace std;
+
+/**
+ * A timer on a TimingWheel. Embed it in whatever it times, so arming one never
+ * allocates. The wheel only links it; type and id are up to the user and are
+ * reported back when it expires
+ */
+typedef struct wheelTimer {
+    struct wheelTimer *next, *prev;
+    uint64_t expires;       // In ticks
+    unsigned int level;
+    bool armed;
+
+    unsigned int type;
+    uint32_t id;
+} wheelTimer;
+
+/**
+ * What advance() reports for an expired timer. Copied out, so the timer itself
+ * may be reused or freed as soon as it expires
+ */
+typedef struct {
+    unsigned int type;
+    uint32_t id;
+} expiredTimer;
+
+/**
+ * Hierarchical timing wheel
+ *
+ * Four levels of 64 slots each; level n holds timers due within 64^(n+1) ticks
+ * and is cascaded into the level below once per 64^n ticks. Arming and
+ * cancelling a timer is O(1) and advancing costs O(1) per tick plus the
+ * timers that expire or cascade, however many timers are armed. Timers due
+ * further out than the wheel spans fire at its horizon instead (~46 hours with
+ * 10 ms ticks).
+ *
+ * Time is taken from CLOCK_MONOTONIC. Thread safe; timers never fire early,
+ * and late by at most one tick plus however late advance() is called
+ */
+class TimingWheel {
+public:
+    /**
+     * @param   tick    Resolution of the wheel, in microseconds
+     */
+    TimingWheel(unsigned int tick) {
+        pthread_mutex_init(&(this->wheelLock), NULL);
+        this->tick = tick;
+        this->current = TimingWheel::now() / tick;
+        this->plannedWake = UINT64_MAX;
+        this->armedCount = 0;
+
+        for (unsigned int l = 0; l < WHEEL_LEVELS; ++l) {
+            this->levelCount[l] = 0;
+            for (unsigned int s = 0; s < WHEEL_SLOTS; ++s) {
+                this->slots[l][s].next = this->slots[l][s].prev = &(this->slots[l][s]);
+            }
+        }
+    }
+
+    virtual ~TimingWheel() {
+        pthread_mutex_destroy(&(this->wheelLock));
+    }
+
+    /**
+     * Prepares a timer for use. Must not be called on an armed timer
+     *
+     * @param   t       The timer
+     * @param   type    Reported back on expiry
+     * @param   id      Reported back on expiry
+     */
+    static void initTimer(wheelTimer *t, unsigned int type, uint32_t id = 0) {
+        t->next = t->prev = NULL;
+        t->armed = false;
+        t->type = type;
+        t->id = id;
+    }
+
+    /**
+     * Arms a timer, re-arming it if it already is
+     *
+     * @param   t       The timer, set up by initTimer()
+     * @param   delay   How long from now it expires, in microseconds
+     * @return  True if it expires before the wake-up last planned by timeout(),
+     *          i.e. whoever blocks on timeout() needs to be woken up
+     */
+    bool schedule(wheelTimer *t, uint64_t delay) {
+        uint64_t expires = (TimingWheel::now() + delay + this->tick - 1) / this->tick;
+
+        pthread_mutex_lock(&(this->wheelLock));
+        if (t->armed) {
+            this->unlink(t);
+        }
+
+        t->expires = expires;
+        this->insert(t);
+
+        bool earlier = expires < this->plannedWake;
+        if (earlier) {
+            this->plannedWake = expires;
+        }
+        pthread_mutex_unlock(&(this->wheelLock));
+
+        return earlier;
+    }
+
+    /**
+     * Disarms a timer. Does nothing if it is not armed
+     */
+    void cancel(wheelTimer *t) {
+        pthread_mutex_lock(&(this->wheelLock));
+        if (t->armed) {
+            this->unlink(t);
+        }
+        pthread_mutex_unlock(&(this->wheelLock));
+    }
+
+    /**
+     * Expires every timer that is due
+     *
+     * @param   expired     The expired timers are appended here
+     */
+    void advance(vector<expiredTimer> &expired) {
+        uint64_t target = TimingWheel::now() / this->tick;
+
+        pthread_mutex_lock(&(this->wheelLock));
+        if (this->armedCount == 0 && this->current <= target) {
+            // Nothing to walk through
+            this->current = target + 1;
+        }
+
+        while (this->current <= target) {
+            unsigned int idx = this->current & WHEEL_MASK;
+
+            if (idx == 0) {
+                // Move the next stretch of every higher level one level down
+                for (unsigned int l = 1; l < WHEEL_LEVELS; ++l) {
+                    unsigned int li = (this->current >> (WHEEL_BITS * l)) & WHEEL_MASK;
+                    this->cascade(l, li);
+
+                    if (li != 0) {
+                        break;
+                    }
+                }
+            }
+
+            wheelTimer *head = &(this->slots[0][idx]);
+            while (head->next != head) {
+                wheelTimer *t = head->next;
+                this->unlink(t);
+
+                expiredTimer e;
+                e.type = t->type;
+                e.id = t->id;
+                expired.push_back(e);
+            }
+
+            this->current++;
+        }
+        pthread_mutex_unlock(&(this->wheelLock));
+    }
+
+    /**
+     * How long the caller may block before advance() has work to do; the
+     * result is remembered to tell schedule() when a wake-up is needed
+     *
+     * @return  Milliseconds until the next timer is due; -1 if none is armed
+     */
+    int timeout() {
+        pthread_mutex_lock(&(this->wheelLock));
+        if (this->armedCount == 0) {
+            this->plannedWake = UINT64_MAX;
+            pthread_mutex_unlock(&(this->wheelLock));
+            return -1;
+        }
+
+        // Higher levels are only looked at when they cascade
+        uint64_t next = UINT64_MAX;
+        if (this->armedCount > this->levelCount[0]) {
+            next = ((this->current & WHEEL_MASK) == 0) ? this->current : (this->current | WHEEL_MASK) + 1;
+        }
+
+        if (this->levelCount[0] > 0) {
+            for (uint64_t t = this->current; t < this->current + WHEEL_SLOTS && t < next; ++t) {
+                wheelTimer *head = &(this->slots[0][t & WHEEL_MASK]);
+                if (head->next != head) {
+                    next = t;
+                    break;
+                }
+            }
+        }
+
+        this->plannedWake = next;
+        pthread_mutex_unlock(&(this->wheelLock));
+
+        uint64_t at = next * this->tick, now = TimingWheel::now();
+        return (at <= now) ? 0 : (int) ((at - now + 999) / 1000);
+    }
+
+    /**
+     * Number of timers currently armed
+     */
+    unsigned int getArmed() {
+        pthread_mutex_lock(&(this->wheelLock));
+        unsigned int ret = this->armedCount;
+        pthread_mutex_unlock(&(this->wheelLock));
+
+        return ret;
+    }
+
+    /**
+     * Current time of CLOCK_MONOTONIC, in microseconds
+     */
+    static uint64_t now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+private:
+    static const unsigned int WHEEL_BITS = 6;
+    static const unsigned int WHEEL_SLOTS = 1 << WHEEL_BITS;
+    static const unsigned int WHEEL_MASK = WHEEL_SLOTS - 1;
+    static const unsigned int WHEEL_LEVELS = 4;
+
+    /**
+     * Links t into the slot matching its expiry, relative to the current tick
+     */
+    void insert(wheelTimer *t) {
+        if (t->expires < this->current) {
+            t->expires = this->current;
+        }
+
+        uint64_t delta = t->expires - this->current;
+        unsigned int level = 0;
+        while (level < WHEEL_LEVELS - 1 && delta >= ((uint64_t) 1 << (WHEEL_BITS * (level + 1)))) {
+            level++;
+        }
+
+        if (level == WHEEL_LEVELS - 1 && delta >= ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS))) {
+            // Beyond the horizon
+            t->expires = this->current + ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        }
+
+        wheelTimer *head = &(this->slots[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK]);
+        t->next = head;
+        t->prev = head->prev;
+        head->prev->next = t;
+        head->prev = t;
+
+        t->level = level;
+        t->armed = true;
+        this->levelCount[level]++;
+        this->armedCount++;
+    }
+
+    void unlink(wheelTimer *t) {
+        t->prev->next = t->next;
+        t->next->prev = t->prev;
+        t->next = t->prev = NULL;
+
+        t->armed = false;
+        this->levelCount[t->level]--;
+        this->armedCount--;
+    }
+
+    /**
+     * Re-inserts every timer of a slot; they land on lower levels
+     */
+    void cascade(unsigned int level, unsigned int slot) {
+        wheelTimer *head = &(this->slots[level][slot]);
+        while (head->next != head) {
+            wheelTimer *t = head->next;
+            this->unlink(t);
+            this->insert(t);
+        }
+    }
+
+    pthread_mutex_t wheelLock;
+
+    unsigned int tick;
+    uint64_t current;       // Next tick to process
+    uint64_t plannedWake;
+    unsigned int armedCount;
+    unsigned int levelCount[WHEEL_LEVELS];
+    wheelTimer slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+#endif
@@ -220,7 +220,7 @@ static std::vector<std::string> split(std::string str, char delim = ' ', int max
  *
  * @return  The name of the local host
  */
-static char *getHostname(char *ipaddr = NULL) {
+static char *getHostname(const char *ipaddr = NULL) {
     char *hostname = new char[1024];
     
     if (ipaddr == NULL) {
@@ -0,0 +1,134 @@
+#ifndef __WORKER_POOL_HPP__
+#define __WORKER_POOL_HPP__
+
+#include <deque>
+#include <vector>
+
+#include <pthread.h>
+
+using namespace std;
+
+/**
+ * For dispatching work items to a fixed pool of pthread workers
+ *
+ * Producers call submitWork(); each item is handed to exactly one worker,
+ * which calls processWork() on it. With no workers started, submitWork()
+ * processes the item on the calling thread instead
+ */
+class WorkerPool {
+public:
+    WorkerPool() {
+        pthread_mutex_init(&(this->jobLock), NULL);
+        pthread_cond_init(&(this->jobCond), NULL);
+        this->stopping = false;
+    }
+
+    virtual ~WorkerPool() {
+        this->stopWorkers();
+        pthread_cond_destroy(&(this->jobCond));
+        pthread_mutex_destroy(&(this->jobLock));
+    }
+
+    /**
+     * Starts count worker threads
+     *
+     * @param   count   Number of workers. 0 processes all work on the submitting thread
+     * @return  True if all workers were started, false otherwise
+     */
+    bool startWorkers(unsigned int count) {
+        this->stopping = false;
+
+        for (unsigned int i = 0; i < count; ++i) {
+            pthread_t worker;
+            if (pthread_create(&worker, NULL, startPoolWorker, this) != 0) {
+                return false;
+            }
+
+            this->workers.push_back(worker);
+        }
+
+        return true;
+    }
+
+    /**
+     * Stops and joins all workers. Work still queued is discarded
+     *
+     * @return  The discarded work items, for the caller to free
+     */
+    vector<void *> stopWorkers() {
+        pthread_mutex_lock(&(this->jobLock));
+        this->stopping = true;
+        pthread_cond_broadcast(&(this->jobCond));
+        pthread_mutex_unlock(&(this->jobLock));
+
+        for (unsigned int i = 0; i < this->workers.size(); ++i) {
+            pthread_join(this->workers[i], NULL);
+        }
+        this->workers.clear();
+
+        vector<void *> discarded(this->jobs.begin(), this->jobs.end());
+        this->jobs.clear();
+
+        return discarded;
+    }
+
+    /**
+     * Queues a work item for the next idle worker
+     *
+     * @param   job     The item to process
+     */
+    void submitWork(void *job) {
+        if (this->workers.empty()) {
+            this->processWork(job);
+            return;
+        }
+
+        pthread_mutex_lock(&(this->jobLock));
+        this->jobs.push_back(job);
+        pthread_cond_signal(&(this->jobCond));
+        pthread_mutex_unlock(&(this->jobLock));
+    }
+
+    unsigned int getWorkerCount() { return this->workers.size(); }
+
+protected:
+    /**
+     * Implement this function to process a submitted work item
+     */
+    virtual void processWork(void *job) = 0;
+
+private:
+    static void *startPoolWorker(void *thisObj) {
+        ((WorkerPool *) thisObj)->workerLoop();
+        return NULL;
+    }
+
+    void workerLoop() {
+        while (true) {
+            pthread_mutex_lock(&(this->jobLock));
+            while (this->jobs.empty() && !this->stopping) {
+                pthread_cond_wait(&(this->jobCond), &(this->jobLock));
+            }
+
+            if (this->stopping) {
+                pthread_mutex_unlock(&(this->jobLock));
+                return;
+            }
+
+            void *job = this->jobs.front();
+            this->jobs.pop_front();
+            pthread_mutex_unlock(&(this->jobLock));
+
+            this->processWork(job);
+        }
+    }
+
+    pthread_mutex_t jobLock;
+    pthread_cond_t jobCond;
+
+    bool stopping;
+    deque<void *> jobs;
+    vector<pthread_t> workers;
+};
+
+#endif
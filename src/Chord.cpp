@@ -1,21 +1,21 @@
+#include <algorithm>
 #include <cerrno>
-#include <climits>
-#include <cmath>
 #include <cstdlib>
 #include <iostream>
 #include <sstream>
 
-#include <gmp.h>
 #include <openssl/sha.h>
 #include <pthread.h>
 
+#include <fcntl.h>
 #include <netdb.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "../include/Chord.hpp"
+#include "../include/KeyHasher.hpp"
 #include "../include/MessageHandler.hpp"
 #include "../include/MessageTypes.hpp"
 #include "../include/ThreadFactory.hpp"
@@ -23,13 +23,71 @@
 
 using namespace std;
 
+/**
+ * Clockwise distance from one ID to another on the ring
+ */
+static inline uint32_t ringDistance(uint32_t from, uint32_t to) {
+    uint32_t d = to - from;
+    
+    if (CHORD_LENGTH_BIT < 32) {
+        d &= (1U << (CHORD_LENGTH_BIT % 32)) - 1;
+    }
+    
+    return d;
+}
+
+/**
+ * Adds a round trip time sample to an estimate, the way RFC 6298 does
+ * 
+ * @param   srtt    Smoothed round trip time; 0 if there is no sample yet
+ * @param   rttvar  Mean deviation of the round trip time
+ * @param   sample  The round trip time measured, in microseconds
+ */
+static inline void updateRtt(uint32_t &srtt, uint32_t &rttvar, uint32_t sample) {
+    if (srtt == 0) {
+        srtt = sample + 1;
+        rttvar = sample / 2;
+        return;
+    }
+    
+    uint32_t err = (sample > srtt) ? sample - srtt : srtt - sample;
+    rttvar = rttvar - rttvar / 4 + err / 4;
+    srtt = srtt - srtt / 8 + sample / 8;
+}
+
+/**
+ * Retransmission timeout of an estimate, srtt + 4 rttvar but at least MIN_RTO,
+ * doubled for every resend so far and at most MAX_RTO
+ * 
+ * @param   initial     The timeout while there is no sample yet
+ * @param   retries     How many times the message was resent already
+ */
+static inline unsigned int retransmitTimeout(uint32_t srtt, uint32_t rttvar, unsigned int initial, unsigned int retries) {
+    uint64_t rto = (srtt == 0) ? initial : (uint64_t) srtt + 4 * (uint64_t) rttvar;
+    rto = max(rto, (uint64_t) MIN_RTO) << min(retries, 16U);
+    
+    return (unsigned int) min(rto, (uint64_t) MAX_RTO);
+}
+
+/**
+ * Whether the service is up and can answer lookups; mapping the ring does not stop it
+ */
+static inline bool inService(ChordStatus::status state) {
+    return state == ChordStatus::SERVICING
+            || state == ChordStatus::MAPPING_CHORD
+            || state == ChordStatus::MAPPING_COMPLETED;
+}
+
 /**
  * Simplified chord service implementation.
  * 
  * Please see SampleApp.cpp on how to use this simplified implementation.
  * 
- * The implementation follows the paper by Stocia et al [1], lacking the
- * failure recovery/fault tolerant features.
+ * The implementation follows the paper by Stocia et al [1], including its
+ * failure recovery: every node keeps a list of SUCCESSOR_LIST_SIZE successors
+ * and fails over to the next one, and peers that stop answering probes are
+ * dropped from the routing state (see test/RingTest.cpp). Keys are not
+ * replicated; moving data off a failed node is up to the application.
  * 
  * The simplified service will allow joining of new nodes, querying of new nodes,
  * and printing the chord map on smaller networks. As per the specification,
@@ -46,8 +104,11 @@ using namespace std;
  * [1] http://pdos.csail.mit.edu/papers/chord:sigcomm01/chord_sigcomm.pdf
  * [2] http://www.cs.nyu.edu/courses/fall07/G22.2631-001/Chord.ppt
  */
-Chord::Chord(unsigned int appPort, unsigned int chordPort, char *thisIpaddr) {
-    if (ipaddr == NULL) {
+Chord::Chord(unsigned int appPort, unsigned int chordPort, char *thisIpaddr)
+        : timers(WHEEL_TICK), inbox(IO_BATCH, MAX_DATAGRAM, false), outbox(IO_BATCH),
+          locations(LOCATION_TTL, LOCATION_CACHE_SIZE), names(NAME_TTL, NAME_CACHE_SIZE),
+          routing(new routingTable()) {
+    if (thisIpaddr == NULL) {
         this->ipaddr = getIpAddr();
     } else {
         this->ipaddr = thisIpaddr;
@@ -56,12 +117,43 @@ Chord::Chord(unsigned int appPort, unsigned int chordPort, char *thisIpaddr) {
     this->chordPort = chordPort;
     this->appPort = appPort;
     
-    pthread_mutex_init(&(this->successorResponseQueueMutex), NULL);
+    pthread_mutex_init(&(this->pendingQueryMutex), NULL);
     pthread_mutex_init(&(this->chordMapResponseQueueMutex), NULL);
     pthread_mutex_init(&(this->sendTimerMutex), NULL);
-    pthread_mutex_init(&(this->fingerMutex), NULL);
+    pthread_mutex_init(&(this->paceMutex), NULL);
+    pthread_mutex_init(&(this->blockedSendMutex), NULL);
+    pthread_rwlock_init(&(this->peerLock), NULL);
 
     this->joinPointIp = NULL;
+    this->selfNode = NULL;
+    this->chord_sfd = -1;
+    this->receiving = false;
+    for (unsigned int i = 0; i < IO_BATCH; ++i) {
+        this->inboxSlots[i] = NULL;
+    }
+    this->workerThreads = DEFAULT_WORKER_THREADS;
+    this->lookupMode = ChordLookup::RECURSIVE;
+    this->stabilizeMisses = 0;
+    this->stabilizeRequestId = 0;
+    this->stabilizeTarget = NULL;
+    this->stabilizeSeq = 0;
+    this->stabilizeInterval = MIN_STABILIZE_INTERVAL;
+    this->predecessorSeen = 0;
+    this->predecessorProbed = 0;
+    this->fingerCursor = 0;
+    this->probedAt = 0;
+    this->probeRetries = 0;
+    this->hintCursor = 0;
+    this->nextRequestId = 1;
+    this->lookupSrtt = 0;
+    this->lookupRttvar = 0;
+    memset(&(this->counters), 0, sizeof(this->counters));
+    TimingWheel::initTimer(&(this->stabilizeTimer), ChordTimer::STABILIZE);
+    TimingWheel::initTimer(&(this->fingerTimer), ChordTimer::FIX_FINGERS);
+    TimingWheel::initTimer(&(this->paceTimer), ChordTimer::PACE);
+    TimingWheel::initTimer(&(this->probeTimer), ChordTimer::PROBE_CHECK);
+    this->paceArmed = false;
+    this->writeWatched = false;
     this->state = ChordStatus::UNINITIALIZED;
 }
 
@@ -76,10 +168,20 @@ Chord::~Chord() {
  */
 bool Chord::init() {
     this->hashedId = this->getConsistentHash(this->ipaddr, strlen(this->ipaddr) + 1);
-    this->predecessor = NULL;
-    this->successor = NULL;
+    
+    // Finger i starts at hashedId + 2^i, wrapping around the ring
+    routingTable *table = this->routing.edit();
+    for (unsigned int i = 0; i < CHORD_LENGTH_BIT; ++i) {
+        this->fingerStart[i] = ringDistance(0, this->hashedId + ((uint32_t) 1 << i));
+        table->fingers[i] = NULL;
+        this->nearest[i] = NULL;
+    }
+    
+    table->predecessor = NULL;
+    table->successorCount = 0;
+    this->routing.publish(table);
     this->hostname = getHostname();
-    this->lastStabilizedTimestamp = 0;
+    this->selfNode = this->createNode();
     
     this->state = ChordStatus::INITIALIZED;
     this->substate = ChordStatus::IN_NETWORK;
@@ -87,12 +189,63 @@ bool Chord::init() {
 }
 
 /**
- * Stops the chord service
+ * Stops the chord service. Only cleans up what start() set up, so it is safe
+ * on a service that never started and when called more than once
  */
 void Chord::stop() {
     this->state = ChordStatus::SERVICE_CLOSING;
-    close(this->chord_sfd);
-    this->waitExit();
+    if (this->receiving) {
+        this->reactor.wakeup();
+        this->waitExit();
+        this->receiving = false;
+    }
+    
+    // Receiver is gone, nothing new can be queued
+    vector<void *> discarded = this->stopWorkers();
+    
+    // Nothing can answer the outstanding lookups any more
+    this->expireQueries();
+    this->timers.cancel(&(this->stabilizeTimer));
+    this->timers.cancel(&(this->fingerTimer));
+    this->timers.cancel(&(this->paceTimer));
+    this->timers.cancel(&(this->probeTimer));
+    
+    pthread_mutex_lock(&(this->paceMutex));
+    for (map<node *, deque<datagram *> >::iterator it = this->deferredSends.begin(); it != this->deferredSends.end(); ++it) {
+        for (unsigned int i = 0; i < it->second.size(); ++i) {
+            this->datagramPool.release(it->second[i]);
+        }
+        __atomic_store_n(&(it->first->deferred), 0U, __ATOMIC_RELAXED);
+    }
+    this->deferredSends.clear();
+    this->paceArmed = false;
+    pthread_mutex_unlock(&(this->paceMutex));
+    
+    pthread_mutex_lock(&(this->blockedSendMutex));
+    for (unsigned int i = 0; i < this->blockedSends.size(); ++i) {
+        this->datagramPool.release(this->blockedSends[i].dg);
+    }
+    this->blockedSends.clear();
+    this->writeWatched = false;
+    pthread_mutex_unlock(&(this->blockedSendMutex));
+    
+    for (unsigned int i = 0; i < discarded.size(); ++i) {
+        this->datagramPool.release((datagram *) discarded[i]);
+    }
+    
+    for (unsigned int i = 0; i < IO_BATCH; ++i) {
+        if (this->inboxSlots[i] != NULL) {
+            this->datagramPool.release(this->inboxSlots[i]);
+            this->inboxSlots[i] = NULL;
+        }
+    }
+    
+    if (this->chord_sfd != -1) {
+        close(this->chord_sfd);
+        this->chord_sfd = -1;
+    }
+    this->reactor.shutdown();
+    this->names.stop();
 }
 
 /**
@@ -118,7 +271,13 @@ bool Chord::start() {
     stringstream ss;
     ss << this->chordPort;
     
-    getaddrinfo(this->hostname, ss.str().c_str(), &hints, &res);
+    // Bound to the address the ring knows this node by, so replies come from it
+    if (getaddrinfo(this->ipaddr, ss.str().c_str(), &hints, &res) != 0) {
+        dprt << "Cannot resolve " << this->ipaddr;
+        this->setErrorno(ERR_CANNOT_CONNECT);
+        this->state = ChordStatus::SERVICE_FAILED;
+        return false;
+    }
     
     this->chord_sfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
     if (this->chord_sfd < 0) {
@@ -135,6 +294,31 @@ bool Chord::start() {
         return false;
     }
     
+    // Messages are drained until EAGAIN, so the socket must not block
+    fcntl(this->chord_sfd, F_SETFL, fcntl(this->chord_sfd, F_GETFL, 0) | O_NONBLOCK);
+    
+    // Set up the reactor: wake on datagrams; timers decide how long it may block
+    if (!this->reactor.open() || !this->reactor.watch(this->chord_sfd)) {
+        dprt << "Cannot set up event loop: " << strerror(errno);
+        this->setErrorno(ERR_CANNOT_CONNECT);
+        this->state = ChordStatus::SERVICE_FAILED;
+        return false;
+    }
+    
+    // Host names are only for display, looked up off the protocol path
+    if (!this->names.start()) {
+        dprt << "Cannot start name resolver: " << strerror(errno);
+        this->setErrorno(ERR_CANNOT_START_THREAD);
+        this->state = ChordStatus::SERVICE_FAILED;
+        return false;
+    }
+    
+    // Received datagrams land directly in pool buffers that are handed to the workers
+    for (unsigned int i = 0; i < IO_BATCH; ++i) {
+        this->inboxSlots[i] = this->datagramPool.acquire();
+        this->inbox.attach(i, this->inboxSlots[i]->data);
+    }
+    
     // Attempt to join, if specified which IP to join
     if (!this->join()) {
         this->setErrorno(ERR_CANNOT_JOIN_CHORD);
@@ -142,8 +326,12 @@ bool Chord::start() {
         return false;
     }
     
-    // Attempt to start receiver thread
-    if (!this->startThread()) {
+    this->armTimer(&(this->stabilizeTimer), MIN_STABILIZE_INTERVAL);
+    this->armTimer(&(this->fingerTimer), PERIODIC_JOBS_TIMEOUT * 2);
+    
+    // Attempt to start message workers, then the receiver thread
+    this->receiving = this->startWorkers(this->workerThreads) && this->startThread();
+    if (!this->receiving) {
         dprt << "Cannot start receiving thread: " << strerror(errno);
         this->setErrorno(ERR_CANNOT_START_THREAD);
         this->state = ChordStatus::SERVICE_FAILED;
@@ -158,505 +346,1986 @@ bool Chord::start() {
 }
 
 /**
- * Processes jobs that require periodic operations
+ * Arms a timer on the timing wheel, waking the reactor up if it is blocked
+ * for longer than the timer allows
+ * 
+ * @param   t       The timer
+ * @param   delay   How long from now it expires, in microseconds
  */
-void Chord::processPeriodicJobs() {
-    // Resend timed out messages
-    pthread_mutex_lock(&(this->sendTimerMutex));
-    for (map<uint32_t, msgTimer *>::iterator it = this->sendTimers.begin(); it != this->sendTimers.end(); ++it) {
-        if (it->second->timestamp + SEND_TIMEOUT <= getTimeInUSeconds()) {
-            dprt << "Resending timed out message...";
-            this->send(it->second->recipient, it->second->context, MessageHandler::getSize(it->second->context));
-            it->second->timestamp = getTimeInUSeconds();
-        }
+void Chord::armTimer(wheelTimer *t, unsigned int delay) {
+    if (this->timers.schedule(t, delay)) {
+        this->reactor.wakeup();
+    }
+}
+
+/**
+ * Runs whatever the expired timers stand for. Only called from the receiver thread
+ */
+void Chord::processTimers() {
+    this->expiredTimers.clear();
+    this->timers.advance(this->expiredTimers);
+    if (this->expiredTimers.empty()) {
+        return;
     }
-    pthread_mutex_unlock(&(this->sendTimerMutex));
     
-    // Stabilize
-    this->stabilize();
+    // Hops of iterative lookups that stopped answering
+    vector<node *> silent;
     
-    // Do the fingering
-    if (!this->successor->isSelf && this->lastFingerUpdateTimestamp + PERIODIC_JOBS_TIMEOUT * 2 <= getTimeInUSeconds()) {
-        pthread_mutex_lock(&(this->fingerMutex));
+    // Resend timed out messages as one batch; contexts stay valid until flushed since we hold the locks
+    pthread_mutex_lock(&(this->sendTimerMutex));
+    pthread_mutex_lock(&(this->pendingQueryMutex));
+    for (unsigned int i = 0; i < this->expiredTimers.size(); ++i) {
+        expiredTimer &e = this->expiredTimers[i];
         
-        for (unsigned int i = 0; i < CHORD_LENGTH_BIT; ++i) {
-            unsigned int searchTerm = pow(2, i);
-            if (UINT_MAX - searchTerm < this->hashedId) {
-                // May overflow the max UINT
-                searchTerm = this->hashedId - (UINT_MAX - searchTerm);
-            } else {
-                searchTerm = this->hashedId + searchTerm;
+        if (e.type == ChordTimer::RESEND) {
+            map<uint32_t, msgTimer *>::iterator it = this->sendTimers.find(e.id);
+            if (it == this->sendTimers.end()) {
+                continue;
             }
             
-            if (this->isInSuccessor(searchTerm)) {
-                this->fingers[searchTerm] = this->successor;
-            } else {
-                SuccessorQuery *sq_finger = MessageHandler::createSuccessorQuery(searchTerm, this->appPort, this->ipaddr);
-                sq_finger->type = MTYPE_FINGER_QUERY;
-                
-                this->send(this->successor, MessageHandler::serialize(sq_finger), sq_finger->size);
+            msgTimer *mt = it->second;
+            if (__atomic_load_n(&(mt->recipient->deferred), __ATOMIC_RELAXED) > 0) {
+                // Still waiting for the recipient's window; another copy would only wait behind it
+                this->timers.schedule(&(mt->timer), this->getRto(mt->recipient, SEND_TIMEOUT, mt->retries));
+                continue;
             }
-        }   
-        
-        pthread_mutex_unlock(&(this->fingerMutex));
-        this->lastFingerUpdateTimestamp = getTimeInUSeconds();
-    }
-}
-
-/**
- * Send out stabilize requests periodically
- */
-void Chord::stabilize() {
-    if (this->successor != NULL && 
-            this->lastStabilizedTimestamp + PERIODIC_JOBS_TIMEOUT <= getTimeInUSeconds()) {
-        if (this->successor->isSelf) {
-            // If my successor is myself, see if I have a predecessor yet. If so, it is my successor
-            if (this->predecessor != NULL) {
-                this->successor = this->predecessor;
-                this->lastStabilizedTimestamp = getTimeInUSeconds();
+            
+            if (++(mt->retries) > MAX_RETRANSMITS) {
+                // The recipient is gone
+                dprt << "Giving up on message to " << mt->recipient->ipaddr;
+                silent.push_back(mt->recipient);
+                this->sendTimers.erase(it);
+                this->timerPool.release(mt);
+                __atomic_fetch_add(&(this->counters.retransmitFailures), 1, __ATOMIC_RELAXED);
+                continue;
             }
-        } else {
-            // Otherwise, send stabilize request
-            this->substate = ChordStatus::STABILIZING;
             
-            StabilizeRequest *streq = MessageHandler::createStabilizeRequest(this->appPort, this->ipaddr);
+            dprt << "Resending timed out message...";
+            this->queueSend(mt->recipient, mt->context, MessageHandler::getSize(mt->context));
+            this->timers.schedule(&(mt->timer), this->getRto(mt->recipient, SEND_TIMEOUT, mt->retries));
+            __atomic_fetch_add(&(this->counters.retransmits), 1, __ATOMIC_RELAXED);
+        } else if (e.type == ChordTimer::LOOKUP_RESEND) {
+            unordered_map<uint32_t, pendingQuery *>::iterator it = this->pendingQueries.find(e.id);
+            if (it == this->pendingQueries.end()) {
+                continue;
+            }
             
-            this->send(this->successor, MessageHandler::serialize(streq), streq->size);
-            this->lastStabilizedTimestamp
-                    = getTimeInUSeconds() + PERIODIC_JOBS_TIMEOUT - 200000;   // 200 ms to receive stablize response
-        }
-    }
-}
-
-/**
- * Implementing ThreadFactory::threadWorker() method for threading
- */
-void Chord::threadWorker() {
-    dprt << "Starting thread worker...";
-    while (true) {
-        int recvSize = 0;
-        
-        // Process timers
-        this->processPeriodicJobs();
-        
-        // Get new messages
-        void *msg = this->receiveMessage(recvSize);
-        if (msg == NULL) {
-            if (recvSize == -1) {
-                dprt << "Cannot listen to socket: " << strerror(errno);
-                break;
-            } else if (recvSize == -2) {
-                // Timeout
-                usleep(100000);
+            pendingQuery *pq = it->second;
+            if (__atomic_load_n(&(pq->recipient->deferred), __ATOMIC_RELAXED) > 0) {
+                // Still waiting for the recipient's window; another copy would only wait behind it
+                this->timers.schedule(&(pq->resend), pq->iterative
+                        ? this->getRto(pq->recipient, HOP_TIMEOUT, pq->retries)
+                        : retransmitTimeout(this->lookupSrtt, this->lookupRttvar, SEND_TIMEOUT, pq->retries));
                 continue;
-            } else {
-                dprt << "Socket closed, returning";
-                break;
             }
-        }
-        
-        // Process each message by type
-        unsigned int type = MessageHandler::getType(msg);
-        switch (type) {
-            case MTYPE_UPDATE_PREDECESSOR:
-            {
-                dprt << "New UpdatePredcessor";
-                UpdatePredcessor *up = (UpdatePredcessor *) msg;
-                
-                // If predecessor is NULL or IP addresses/Port do not match, update predecessor
-                if (this->predecessor == NULL
-                        || (strcmp(this->predecessor->ipaddr, up->predecessor) != 0
-                                || this->predecessor->appPort != up->appPort)) {
-                    this->predecessor = this->createNode(up->predecessor);
-                    this->predecessor->appPort = up->appPort;
+            
+            if (++(pq->retries) > (pq->iterative ? HOP_RETRIES : MAX_RETRANSMITS)) {
+                // Fail now instead of at the deadline; for iterative lookups, the hop is gone
+                if (pq->iterative) {
+                    silent.push_back(pq->recipient);
                 }
-                
-                // Acknowledge the update
-                UpdatePredcessorAck *upAck = MessageHandler::createUpdatePredecessorAck(this->predecessor->hashedId);
-                this->send(this->predecessor, MessageHandler::serialize(upAck), upAck->size);
-                
-                // Notify the implementing application about the change, have to move files
-                this->pushNotification(new ChordNotification(
-                        ChordNotification::NTYPE_SYNC_NOTIFICATION,
-                        this->predecessor->ipaddr,
-                        this->predecessor->appPort
-                ));
-                
-                break;
+                e.type = ChordTimer::LOOKUP_DEADLINE;
+                __atomic_fetch_add(&(this->counters.retransmitFailures), 1, __ATOMIC_RELAXED);
+                continue;
             }
-            case MTYPE_UPDATE_PREDECESSOR_ACK:
-            {
-                dprt << "New UpdatePredcessorAck";
-                UpdatePredcessorAck *upAck = (UpdatePredcessorAck *) msg;
-                
-                // Remove timers
-                if (upAck->hashedId == this->hashedId) {
-                    this->unsetSendTimer(upAck->hashedId);
+            
+            if (!pq->iterative) {
+                // Route again, around whatever failed since
+                node *route = this->getSuccessorOf(pq->keyhash);
+                if (route != NULL && !route->isSelf) {
+                    pq->recipient = route;
                 }
-                
-                break;
             }
-            case MTYPE_STABILIZE_REQUEST:
-            {
-                dprt << "New StabilizeRequest";
-                StabilizeRequest *streq = (StabilizeRequest *) msg;
-                
-                if (this->predecessor == NULL) {
-                    // If no predecessor, then this is the requestor's successor, so we can update safely
-                    this->predecessor = this->createNode(streq->sender);
-                    this->predecessor->appPort = streq->appPort;
-                }
-                
-                StabilizeResponse *stres = MessageHandler::createStabilizeResponse(
-                        this->predecessor->appPort, this->predecessor->ipaddr
-                );
-                
-                this->send(this->createNode(streq->sender), MessageHandler::serialize(stres), stres->size);
-                
+            
+            dprt << "Resending lookup " << e.id;
+            this->queueSend(pq->recipient, pq->query.data, pq->query.len);
+            this->timers.schedule(&(pq->resend), pq->iterative
+                    ? this->getRto(pq->recipient, HOP_TIMEOUT, pq->retries)
+                    : retransmitTimeout(this->lookupSrtt, this->lookupRttvar, SEND_TIMEOUT, pq->retries));
+            __atomic_fetch_add(&(this->counters.retransmits), 1, __ATOMIC_RELAXED);
+        }
+    }
+    this->flushSends();
+    pthread_mutex_unlock(&(this->pendingQueryMutex));
+    pthread_mutex_unlock(&(this->sendTimerMutex));
+    
+    for (unsigned int i = 0; i < silent.size(); ++i) {
+        this->failPeer(silent[i]);
+    }
+    
+    for (unsigned int i = 0; i < this->expiredTimers.size(); ++i) {
+        switch (this->expiredTimers[i].type) {
+            case ChordTimer::STABILIZE:
+                this->stabilize();
                 break;
-            }
-            case MTYPE_STABILIZE_RESPONSE:
-            {
-                dprt << "New StabilizeResponse";
-                
-                if (this->substate == ChordStatus::STABILIZING) {
-                    // Proceed only if in STABILIZING state
-                    StabilizeResponse *stres = (StabilizeResponse *) msg;
-                    if (strcmp(stres->predecessor, this->ipaddr) != 0
-                            || stres->appPort != this->appPort) {
-                        this->successor = this->createNode(stres->predecessor);
-                        this->successor->appPort = stres->appPort;
-                    }
-                    
-                    this->lastStabilizedTimestamp = getTimeInUSeconds();
-                    this->substate = ChordStatus::IN_NETWORK;
-                }
-                
+            case ChordTimer::FIX_FINGERS:
+                this->fixFingers();
+                // Give back what a burst of traffic grew the pools by
+                this->datagramPool.trim();
+                this->timerPool.trim();
+                this->queryPool.trim();
                 break;
-            }
-            case MTYPE_CHORD_MAP_QUERY:
-            {
-                dprt << "New ChordMapQuery";
-                ChordMapQuery *cmq = (ChordMapQuery *) msg;
-                
-                if (strcmp(cmq->sender, this->ipaddr) == 0) {
-                    // Query looped back to self
-                    if (this->state == ChordStatus::MAPPING_CHORD) {
-                        this->state = ChordStatus::MAPPING_COMPLETED;
-                    }
-                    
-                    break;
-                }
-                
-                // Pass onto the successor with next sequence (used for tracking which one came first
-                ChordMapResponse *cmr = MessageHandler::createChordMapResponse(cmq->seq + 1, this->ipaddr);
-                if (this->successor == NULL) {
-                    // Set sequence to 0 to indicate deadend (broken ring)
-                    cmr->seq = 0;
-                }
-                
-                // Send my information back to the originator
-                this->send(createNode(cmq->sender), MessageHandler::serialize(cmr), cmr->size);
-                
-                if (this->successor != NULL) {
-                    cmq->seq++;
-                    this->send(this->successor, MessageHandler::serialize(cmq), cmq->size);
-                }
-                
+            case ChordTimer::LOOKUP_DEADLINE:
+                this->expireQuery(this->expiredTimers[i].id);
                 break;
-            }
-            case MTYPE_CHORD_MAP_RESPONSE:
-            {
-                dprt << "New ChordMapResponse";
-                if (this->state != ChordStatus::MAPPING_CHORD) {
-                    // If I did not originate it, I should not receive a response
-                    break;
-                }
-                
-                ChordMapResponse *cmr = (ChordMapResponse *) msg;
-                this->pushChordMapResponse(cmr);
-                
-                if (cmr->seq == 0) {
-                    // A deadend response
-                    this->state = ChordStatus::MAPPING_COMPLETED;
-                }
-                
+            case ChordTimer::PACE:
+                this->drainDeferredSends();
                 break;
-            }
-            case MTYPE_JOIN_SUCCESSOR_QUERY:
-                dprt << "New JoinSuccessorQuery";
-            case MTYPE_FINGER_QUERY:
-                dprt << "New FingerQuery";
-            case MTYPE_SUCCESSOR_QUERY:
-            {
-                dprt << "New SuccessorQuery";
-                SuccessorQuery *sq = (SuccessorQuery *) msg;
-                
-                if (strcmp(sq->sender, this->ipaddr) == 0) {
-                    // Happens if the packet I sent looped back to me
-                    SuccessorResponse *sr = MessageHandler::createSuccessorResponse(
-                            sq->searchTerm,
-                            this->appPort,
-                            this->ipaddr
-                    );
-                    
-                    if (type == MTYPE_FINGER_QUERY) {
-                        this->fingers[sq->searchTerm] = createNode();
-                    } else {
-                        this->pushSuccessorResponse(sr);
-                    }
-                } else if (this->successor->isSelf) {
-                    // If no successor and predecessor, this is a single node or first node in chord
-                    SuccessorResponse *sr = MessageHandler::createSuccessorResponse(
-                            sq->searchTerm,
-                            this->appPort,
-                            this->ipaddr
-                    );
-                    
-                    if (type == MTYPE_FINGER_QUERY) {
-                        sr->type = MTYPE_FINGER_RESPONSE;
-                    }
-                    
-                    node *tmp = createNode(sq->sender);
-                    this->successor = tmp;
-                    this->successor->appPort = sq->appPort;
-                    this->send(tmp, MessageHandler::serialize(sr), sr->size);
-                    
-                    delete[] sr->responder;
-                    delete sr;
-                } else if (this->isInSuccessor(sq->searchTerm)) {
-                    /*
-                     * If ID satisfies successor requirement: > this id && <= successor id
-                     * If ID > my id and, successor id < my id, then this is the last node clockwise in chord
-                     * In both cases, send successor info to the requestor
-                     */
-                    SuccessorResponse *sr = MessageHandler::createSuccessorResponse(
-                            sq->searchTerm,
-                            this->successor->appPort,
-                            this->successor->ipaddr
-                    );
-                    
-                    if (type == MTYPE_FINGER_QUERY) {
-                        sr->type = MTYPE_FINGER_RESPONSE;
-                    }
-                    
-                    this->send(this->createNode(sq->sender), MessageHandler::serialize(sr), sr->size);
-                    
-                    delete[] sr->responder;
-                    delete sr;
-                } else {
-                    // Forward the request to the successor
-                    if (type == MTYPE_SUCCESSOR_QUERY || type == MTYPE_JOIN_SUCCESSOR_QUERY) {
-                        if (type == MTYPE_JOIN_SUCCESSOR_QUERY) {
-                            this->send(this->getSuccessorOf(sq->searchTerm, false), MessageHandler::serialize(sq), sq->size);
-                        } else {
-                            this->send(this->getSuccessorOf(sq->searchTerm, true), MessageHandler::serialize(sq), sq->size);
-                        }
-                    }
-                }
-                
-                delete[] sq->sender;
-                delete sq;
+            case ChordTimer::PROBE_CHECK:
+                this->checkProbes();
                 break;
+        }
+    }
+}
+
+/**
+ * Refreshes the finger table
+ * 
+ * Any node in [fingerStart[i], fingerStart[i + 1]) serves as finger i without
+ * adding hops, so the one with the lowest round trip time is taken where one is
+ * known. Otherwise finger i is the successor of fingerStart[i], which needs no
+ * lookup if the successor or finger i - 1 already lies at or past it. Of the
+ * rest, FINGER_QUERIES_PER_ROUND are looked up per round in turn, so the
+ * traffic grows with the number of distinct fingers, about log N
+ */
+void Chord::fixFingers() {
+    node *succ = this->getSuccessor();
+    if (succ != NULL && !succ->isSelf) {
+        this->probePeers();
+        
+        // The finger queries go out as one burst, encoded into pool buffers released once flushed
+        vector<datagram *> queued;
+        // Fingers the successor covers, updated in one go
+        uint64_t covered = 0;
+        // Whether a finger that needs a lookup has none yet
+        bool unknown = false;
+        
+        unsigned int i = this->fingerCursor;
+        for (unsigned int n = 0; n < CHORD_LENGTH_BIT; ++n, i = (i + 1) % CHORD_LENGTH_BIT) {
+            uint32_t searchTerm = this->fingerStart[i];
+            node *closest = this->nearest[i];
+            if (closest != NULL) {
+                this->setFingers((uint64_t) 1 << i, closest);
+                continue;
+            }
+            
+            if (this->isInSuccessor(searchTerm, this->hashedId, succ->hashedId)) {
+                covered |= (uint64_t) 1 << i;
+                continue;
+            }
+            
+            // Finger i - 1 succeeds its own start; if it lies at or past mine, it succeeds mine too
+            node *prev = (i > 0) ? this->getFinger(i - 1) : NULL;
+            if (prev != NULL && !prev->isSelf && ringDistance(this->hashedId, prev->hashedId) >= ((uint32_t) 1 << i)) {
+                this->setFingers((uint64_t) 1 << i, prev);
+                continue;
             }
-            case MTYPE_FINGER_RESPONSE:
-            case MTYPE_SUCCESSOR_RESPONSE:
-            {   
-                //dprt << "New SuccessorResponse";
-                SuccessorResponse *sr = (SuccessorResponse *) msg;
+            
+            unknown = unknown || this->getFinger(i) == NULL;
+            if (queued.size() < FINGER_QUERIES_PER_ROUND) {
+                SuccessorQuery sq_finger = MessageHandler::makeSuccessorQuery(searchTerm, this->appPort, this->ipaddr);
+                sq_finger.type = MTYPE_FINGER_QUERY;
                 
-                if (type == MTYPE_FINGER_RESPONSE) {
-                    pthread_mutex_lock(&(this->fingerMutex));
-                    this->fingers[sr->searchTerm] = createNode(sr->responder);
-                    this->fingers[sr->searchTerm]->appPort = sr->appPort;
-                    
-                    dprt << "Finger Response from " << fingers[sr->searchTerm]->hostname;
-                    
-                    pthread_mutex_unlock(&(this->fingerMutex));
-                } else {
-                    this->pushSuccessorResponse(sr);
-                }
-
-                break;
+                datagram *dg = this->datagramPool.acquire();
+                dg->len = MessageHandler::encode(&sq_finger, dg->data, sizeof(dg->data));
+                this->queueSend(succ, dg->data, dg->len);
+                queued.push_back(dg);
+                this->fingerCursor = (i + 1) % CHORD_LENGTH_BIT;
             }
-            default:
-                dprt << "Cannot identify type";
         }
         
-        usleep(100000);
+        this->flushSends();
+        for (unsigned int i = 0; i < queued.size(); ++i) {
+            this->datagramPool.release(queued[i]);
+        }
+        
+        this->setFingers(covered, succ);
+        
+        // Until the lookups get to them, the successor's table fills the gaps in one round trip
+        if (unknown) {
+            this->requestFingerTable(succ);
+        }
     }
+    
+    this->armTimer(&(this->fingerTimer), PERIODIC_JOBS_TIMEOUT * 2);
 }
 
 /**
- * Start querying on the successor chains
+ * Asks a peer for every node it routes by, to fill in fingers from in one round trip
  * 
- * @param   key         Key to search for
- * @param   *hostip     Pointer to a pointer to character array. This will be set to the host
- *                      that possesses key upon function returns
- * @param   &hostport   Indicating which port the host that possesses the key runs on
- * @param   timeout     How long to wait for query, specified in milliseconds. Default is 0
- * @return  The key being queried
+ * @param   n   The peer to ask, normally the successor
  */
-char *Chord::query(char *key, char **hostip, unsigned int &hostport, unsigned int timeout) {
-    if (key == NULL) {
-        return NULL;
+void Chord::requestFingerTable(node *n) {
+    if (n == NULL || n->isSelf) {
+        return;
+    }
+    
+    unsigned char buffer[MAX_DATAGRAM];
+    StabilizeRequest ftreq = MessageHandler::makeStabilizeRequest(this->appPort, this->ipaddr);
+    ftreq.type = MTYPE_FINGER_TABLE_REQUEST;
+    this->send(n, buffer, MessageHandler::encode(&ftreq, buffer, sizeof(buffer)));
+}
+
+/**
+ * Takes fingers from nodes another peer routes by. For each finger start the
+ * successor doesn't cover, the candidate nearest past the start replaces the
+ * finger if it is nearer than the one known. Fingers held by the nearest peer in
+ * their interval are left alone, and the regular refresh corrects stale ones
+ * 
+ * @param   candidates  The nodes; NULL entries are skipped
+ */
+void Chord::adoptFingers(const vector<node *> &candidates) {
+    node *succ, *fingers[CHORD_LENGTH_BIT];
+    {
+        SnapshotCell<routingTable>::Reader table(this->routing);
+        succ = (table->successorCount > 0) ? table->successors[0] : NULL;
+        memcpy(fingers, table->fingers, sizeof(fingers));
     }
     
-    if (this->successor == NULL || this->successor->isSelf) {
-        *hostip = new char[strlen(this->ipaddr) + 1];
-        strcpy(*hostip, this->ipaddr);
-        hostport = this->appPort;
-        return key;
+    if (succ == NULL || succ->isSelf) {
+        return;
     }
     
-    // If this successor may have it
-    unsigned int keyhash = this->getConsistentHash(key, strlen(key) + 1);
-    if (this->isInSuccessor(keyhash)) {
-        *hostip = new char[strlen(this->successor->ipaddr) + 1];
-        strcpy(*hostip, this->successor->ipaddr);
-        hostport = this->successor->appPort;
+    // Fingers to set, per candidate
+    vector<uint64_t> which(candidates.size(), 0);
+    for (unsigned int i = 0; i < CHORD_LENGTH_BIT; ++i) {
+        uint32_t start = this->fingerStart[i];
+        if (__atomic_load_n(&(this->nearest[i]), __ATOMIC_RELAXED) != NULL
+                || this->isInSuccessor(start, this->hashedId, succ->hashedId)) {
+            continue;
+        }
+        
+        node *current = fingers[i];
+        uint32_t best = (current != NULL && !current->isSelf) ? ringDistance(start, current->hashedId) : UINT32_MAX;
+        int pick = -1;
+        for (unsigned int c = 0; c < candidates.size(); ++c) {
+            if (candidates[c] != NULL && !candidates[c]->isSelf && !__atomic_load_n(&(candidates[c]->failed), __ATOMIC_RELAXED)
+                    && ringDistance(start, candidates[c]->hashedId) < best) {
+                best = ringDistance(start, candidates[c]->hashedId);
+                pick = c;
+            }
+        }
         
-        dprt << "Setting hostip to " << *hostip << " and port to " << hostport;
-        return key;
+        if (pick >= 0) {
+            which[pick] |= (uint64_t) 1 << i;
+        }
     }
     
-    node *sendto = this->getSuccessorOf(keyhash);
+    for (unsigned int c = 0; c < candidates.size(); ++c) {
+        this->setFingers(which[c], candidates[c]);
+    }
+}
+
+/**
+ * Adds routing hints to an outgoing message: my successor first, then peers
+ * that answered a probe lately. They are taken in turn from the ones I route
+ * by, so that a run of messages spreads all of them
+ * 
+ * @param   hints       The hints of the message
+ * @param   size        The size of the message, grown with the hints
+ * @param   recipient   Where the message goes; it is not hinted to itself
+ */
+void Chord::addHints(RoutingHints &hints, uint32_t &size, node *recipient) {
+    node *succ;
+    vector<node *> known;
+    {
+        SnapshotCell<routingTable>::Reader table(this->routing);
+        succ = (table->successorCount > 0) ? table->successors[0] : NULL;
+        for (unsigned int i = 1; i < table->successorCount; ++i) {
+            known.push_back(table->successors[i]);
+        }
+        known.push_back(table->predecessor);
+        for (unsigned int i = 0; i < CHORD_LENGTH_BIT; ++i) {
+            known.push_back(table->fingers[i]);
+        }
+    }
     
-    // If the successor does not have it, forward it to the successor and let him deal with it
-    SuccessorQuery *sq = MessageHandler::createSuccessorQuery(keyhash, this->appPort, this->ipaddr);
-    unsigned char *serialized = MessageHandler::serialize(sq);
-    
-    this->send(sendto, serialized, sq->size);
-    this->pushSendTimer(sendto, keyhash, serialized, sq->size);
-    
-    // We deal with microseconds internally
-    timeout = timeout * 1000;
-    unsigned int startTime = getTimeInUSeconds();
-    
-    SuccessorResponse *sr = NULL;
-    while (timeout == 0 || startTime + timeout > getTimeInUSeconds()) {
-        // Wait for a new SuccessResponse from any node
-        sr = this->popSuccessorResponse();
-        if (sr == NULL) {
-            usleep(100000);
+    if (succ == NULL || succ->isSelf || !MessageHandler::addHint(hints, size, __atomic_load_n(&(succ->appPort), __ATOMIC_RELAXED), succ->ipaddr)) {
+        return;
+    }
+    hints.senderId = this->hashedId;
+    
+    // Stabilize backs off only while it finds the same successors; while it does
+    // not, my successor may be stale and its range should not be cached anywhere
+    hints.flags = 0;
+    if (__atomic_load_n(&(this->stabilizeInterval), __ATOMIC_RELAXED) > 2 * MIN_STABILIZE_INTERVAL) {
+        hints.flags |= HINT_SETTLED_SUCCESSOR;
+    }
+    
+    uint64_t now = TimingWheel::now();
+    unsigned int start = __atomic_fetch_add(&(this->hintCursor), 1, __ATOMIC_RELAXED);
+    vector<node *> added(1, succ);
+    for (unsigned int i = 0; i < known.size() && hints.count < MAX_HINTS; ++i) {
+        node *n = known[(start + i) % known.size()];
+        if (n == NULL || n->isSelf || n == recipient || find(added.begin(), added.end(), n) != added.end()) {
             continue;
         }
         
-        // If this is not for me, ignore
-        if (sr->searchTerm == keyhash) {
-            *hostip = new char[strlen(sr->responder) + 1];
-            strcpy(*hostip, sr->responder);
-            hostport = sr->appPort;
-            
-            dprt << "Setting hostip to " << *hostip << " and port to " << hostport;
-            break;
+        uint64_t seen = __atomic_load_n(&(n->rttSeen), __ATOMIC_RELAXED);
+        if (seen != 0 && now - seen <= RTT_TTL && MessageHandler::addHint(hints, size, __atomic_load_n(&(n->appPort), __ATOMIC_RELAXED), n->ipaddr)) {
+            added.push_back(n);
+        }
+    }
+}
+
+/**
+ * Feeds the routing hints of a received message into the location cache and
+ * the fingers
+ * 
+ * @param   msg     The message
+ * @param   at      Where its hints start, from the hints() of its view
+ */
+void Chord::takeHints(const MessageView &msg, size_t at) {
+    uint32_t count = msg.hintCount(at);
+    vector<node *> candidates;
+    for (uint32_t i = 0; i < count; ++i) {
+        const char *ip = msg.hintIp(at, i);
+        node *n = (ip != NULL) ? this->getPeer(ip, msg.hintPort(at, i)) : NULL;
+        if (n != NULL && !n->isSelf && !__atomic_load_n(&(n->failed), __ATOMIC_RELAXED)) {
+            candidates.push_back(n);
+        }
+    }
+    
+    if (candidates.empty()) {
+        return;
+    }
+    
+    // The sender's successor owns everything from the sender up to it, if it has
+    // held for a while and no node I know of lies in between
+    node *succ = candidates[0];
+    uint32_t sender = msg.hintSender(at);
+    uint32_t range = ringDistance(sender, succ->hashedId);
+    bool settled = (msg.hintFlags(at) & HINT_SETTLED_SUCCESSOR) != 0 && msg.hintIp(at, 0) != NULL
+            && strcmp(succ->ipaddr, msg.hintIp(at, 0)) == 0;
+    if (settled) {
+        vector<node *> known(1, this->selfNode);
+        {
+            SnapshotCell<routingTable>::Reader table(this->routing);
+            known.insert(known.end(), table->successors, table->successors + table->successorCount);
+            known.insert(known.end(), table->fingers, table->fingers + CHORD_LENGTH_BIT);
+            known.push_back(table->predecessor);
+        }
+        
+        for (unsigned int i = 0; i < known.size() && settled; ++i) {
+            uint32_t d = (known[i] != NULL) ? ringDistance(sender, known[i]->hashedId) : 0;
+            settled = d == 0 || d >= range;
+        }
+    }
+    
+    if (settled) {
+        this->locations.insert(sender, succ->hashedId, succ->ipaddr, __atomic_load_n(&(succ->appPort), __ATOMIC_RELAXED));
+    }
+    
+    this->adoptFingers(candidates);
+}
+
+/**
+ * Finds the nearest live peer in each finger interval and probes the round
+ * trip time of every peer I route by, and of up to PROBES_PER_ROUND others
+ * that are due for a new sample. Peers that do not answer are given up on by
+ * checkProbes(), so a failed finger is not routed to until its sample expires.
+ * Only called from the receiver thread
+ */
+void Chord::probePeers() {
+    uint64_t now = TimingWheel::now();
+    node *best[CHORD_LENGTH_BIT];
+    memset(best, 0, sizeof(best));
+    vector<node *> known, due;
+    {
+        SnapshotCell<routingTable>::Reader table(this->routing);
+        known.insert(known.end(), table->successors, table->successors + table->successorCount);
+        known.push_back(table->predecessor);
+        known.insert(known.end(), table->fingers, table->fingers + CHORD_LENGTH_BIT);
+    }
+    
+    // Every peer I route by, each once
+    for (unsigned int i = 0; i < known.size(); ++i) {
+        if (known[i] != NULL && !known[i]->isSelf && find(due.begin(), due.end(), known[i]) == due.end()) {
+            due.push_back(known[i]);
+        }
+    }
+    size_t routed = due.size();
+    
+    pthread_rwlock_rdlock(&(this->peerLock));
+    for (map<string, node *>::iterator it = this->peers.begin(); it != this->peers.end(); ++it) {
+        node *p = it->second;
+        uint32_t toPeer = ringDistance(this->hashedId, p->hashedId);
+        uint64_t seen = __atomic_load_n(&(p->rttSeen), __ATOMIC_RELAXED);
+        if (toPeer == 0 || seen == 0 || now - seen > RTT_TTL) {
+            continue;
+        }
+        
+        // Finger interval i holds the distances [2^i, 2^(i + 1))
+        int i = 31 - __builtin_clz(toPeer);
+        if (best[i] == NULL
+                || __atomic_load_n(&(p->srtt), __ATOMIC_RELAXED) < __atomic_load_n(&(best[i]->srtt), __ATOMIC_RELAXED)) {
+            best[i] = p;
+        }
+    }
+    
+    // Round robin from where the last round stopped, so every peer gets its turn
+    map<string, node *>::iterator it = this->peers.upper_bound(this->probeCursor);
+    for (size_t n = 0; n < this->peers.size() && due.size() < routed + PROBES_PER_ROUND; ++n, ++it) {
+        if (it == this->peers.end()) {
+            it = this->peers.begin();
+        }
+        
+        if (now - __atomic_load_n(&(it->second->rttSeen), __ATOMIC_RELAXED) >= PERIODIC_JOBS_TIMEOUT * 2
+                && find(due.begin(), due.begin() + routed, it->second) == due.begin() + routed) {
+            due.push_back(it->second);
+            this->probeCursor = it->first;
+        }
+    }
+    pthread_rwlock_unlock(&(this->peerLock));
+    
+    for (unsigned int i = 0; i < CHORD_LENGTH_BIT; ++i) {
+        __atomic_store_n(&(this->nearest[i]), best[i], __ATOMIC_RELEASE);
+    }
+    
+    // Every probe is the same message, so they share a buffer
+    unsigned char buffer[MAX_DATAGRAM];
+    Probe probe = MessageHandler::makeProbe((uint32_t) now, this->appPort, this->ipaddr);
+    size_t len = MessageHandler::encode(&probe, buffer, sizeof(buffer));
+    for (unsigned int i = 0; i < due.size(); ++i) {
+        this->queueSend(due[i], buffer, len);
+    }
+    this->flushSends();
+    
+    this->probed.swap(due);
+    this->probedAt = now;
+    this->probeRetries = 0;
+    this->armTimer(&(this->probeTimer), SUCCESSOR_TIMEOUT);
+}
+
+/**
+ * Gives up on the peers that did not answer the last round of probes, after
+ * probing them PROBE_RETRIES more times. Only called from the receiver thread
+ */
+void Chord::checkProbes() {
+    vector<node *> silent;
+    for (unsigned int i = 0; i < this->probed.size(); ++i) {
+        if (__atomic_load_n(&(this->probed[i]->rttSeen), __ATOMIC_RELAXED) < this->probedAt) {
+            silent.push_back(this->probed[i]);
+        }
+    }
+    this->probed.swap(silent);
+    
+    if (this->probed.empty()) {
+        return;
+    }
+    
+    if (this->probeRetries < PROBE_RETRIES) {
+        // A lost datagram should not cost a peer its place; ask once more
+        uint64_t now = TimingWheel::now();
+        unsigned char buffer[MAX_DATAGRAM];
+        Probe probe = MessageHandler::makeProbe((uint32_t) now, this->appPort, this->ipaddr);
+        size_t len = MessageHandler::encode(&probe, buffer, sizeof(buffer));
+        for (unsigned int i = 0; i < this->probed.size(); ++i) {
+            this->queueSend(this->probed[i], buffer, len);
+        }
+        this->flushSends();
+        
+        this->probedAt = now;
+        ++(this->probeRetries);
+        this->armTimer(&(this->probeTimer), SUCCESSOR_TIMEOUT);
+        return;
+    }
+    
+    for (unsigned int i = 0; i < this->probed.size(); ++i) {
+        dprt << "Peer " << this->probed[i]->ipaddr << " does not answer probes";
+        this->failPeer(this->probed[i]);
+    }
+    this->probed.clear();
+}
+
+/**
+ * Adds a round trip time sample to a peer. Only messages that were not resent
+ * give samples, as it is unknown which copy was answered otherwise
+ * 
+ * @param   n       The peer that answered
+ * @param   sample  The round trip time measured, in microseconds
+ */
+void Chord::sampleRtt(node *n, uint32_t sample) {
+    if (n == NULL || n->isSelf || sample > RTT_TTL) {
+        // A late or forged echo says nothing about the peer now
+        return;
+    }
+    
+    // Concurrent samples of one peer may lose one of them, which the smoothing hides
+    uint32_t srtt = __atomic_load_n(&(n->srtt), __ATOMIC_RELAXED);
+    uint32_t rttvar = __atomic_load_n(&(n->rttvar), __ATOMIC_RELAXED);
+    updateRtt(srtt, rttvar, sample);
+    __atomic_store_n(&(n->srtt), srtt, __ATOMIC_RELAXED);
+    __atomic_store_n(&(n->rttvar), rttvar, __ATOMIC_RELAXED);
+    __atomic_store_n(&(n->rttSeen), TimingWheel::now(), __ATOMIC_RELAXED);
+    __atomic_store_n(&(n->failed), false, __ATOMIC_RELAXED);
+    
+    uint32_t rttMin = __atomic_load_n(&(n->rttMin), __ATOMIC_RELAXED);
+    if (rttMin == 0 || sample + 1 < rttMin) {
+        __atomic_store_n(&(n->rttMin), sample + 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Returns how long to wait for a peer to answer before resending
+ * 
+ * @param   n       The peer
+ * @param   initial The timeout if its round trip time is not measured yet
+ * @param   retries How many times the message was resent already
+ * @return  The timeout in microseconds
+ */
+unsigned int Chord::getRto(node *n, unsigned int initial, unsigned int retries) {
+    return retransmitTimeout(
+            __atomic_load_n(&(n->srtt), __ATOMIC_RELAXED),
+            __atomic_load_n(&(n->rttvar), __ATOMIC_RELAXED),
+            initial,
+            retries
+    );
+}
+
+/**
+ * Send out stabilize requests periodically
+ */
+void Chord::stabilize() {
+    node *succ = this->getSuccessor();
+    unsigned int next = __atomic_load_n(&(this->stabilizeInterval), __ATOMIC_RELAXED);
+    
+    // A predecessor that stopped stabilizing with me, or did not answer the probe
+    // it got when someone behind it notified me, is presumed gone, so whoever is
+    // behind it can take over
+    node *pred = this->getPredecessor();
+    uint64_t now = TimingWheel::now();
+    uint64_t probed = __atomic_load_n(&(this->predecessorProbed), __ATOMIC_RELAXED);
+    if (pred != NULL) {
+        if (probed != 0 && __atomic_load_n(&(pred->rttSeen), __ATOMIC_RELAXED) >= probed) {
+            __atomic_store_n(&(this->predecessorProbed), (uint64_t) 0, __ATOMIC_RELAXED);
+        } else if ((probed != 0 && now - probed > SUCCESSOR_TIMEOUT)
+                || now - __atomic_load_n(&(this->predecessorSeen), __ATOMIC_RELAXED) > PREDECESSOR_TIMEOUT) {
+            dprt << "Predecessor " << pred->ipaddr << " is gone";
+            this->setPredecessor(NULL);
+            __atomic_store_n(&(this->predecessorProbed), (uint64_t) 0, __ATOMIC_RELAXED);
+        }
+    }
+    
+    if (succ != NULL && !succ->isSelf
+            && __atomic_load_n(&(this->substate), __ATOMIC_RELAXED) == ChordStatus::STABILIZING
+            && __atomic_add_fetch(&(this->stabilizeMisses), 1, __ATOMIC_RELAXED) > STABILIZE_RETRIES) {
+        // The successor did not answer; the next one in the list takes over
+        dprt << "Successor " << succ->ipaddr << " is not responding";
+        __atomic_store_n(&(this->stabilizeRequestId), (uint32_t) 0, __ATOMIC_RELAXED);
+        this->failPeer(succ);
+        __atomic_store_n(&(this->stabilizeMisses), 0, __ATOMIC_RELAXED);
+        succ = this->getSuccessor();
+    }
+    
+    if (succ != NULL) {
+        if (succ->isSelf) {
+            // If my successor is myself, see if I have a predecessor yet. If so, it is my successor
+            node *pred = this->getPredecessor();
+            if (pred != NULL) {
+                this->setSuccessor(pred);
+                next = MIN_STABILIZE_INTERVAL;
+            }
         } else {
-            usleep(100000);
+            // Otherwise, send stabilize request
+            __atomic_store_n(&(this->substate), ChordStatus::STABILIZING, __ATOMIC_RELAXED);
+            
+            // Only the answer to this request, from this successor, is taken
+            if (++(this->stabilizeSeq) == 0) {
+                ++(this->stabilizeSeq);
+            }
+            __atomic_store_n(&(this->stabilizeTarget), succ, __ATOMIC_RELAXED);
+            __atomic_store_n(&(this->stabilizeRequestId), this->stabilizeSeq, __ATOMIC_RELEASE);
+            
+            unsigned char buffer[MAX_DATAGRAM];
+            StabilizeRequest streq = MessageHandler::makeStabilizeRequest(this->appPort, this->ipaddr, this->stabilizeSeq);
+            
+            this->send(succ, buffer, MessageHandler::encode(&streq, buffer, sizeof(buffer)));
+            
+            // The response re-arms the timer; this only applies if it never comes
+            next = SUCCESSOR_TIMEOUT;
+        }
+    }
+    
+    this->armTimer(&(this->stabilizeTimer), next);
+}
+
+/**
+ * Has the next stabilize round come soon, as something changed around this
+ * node. The interval grows back while the successor's answers stay the same
+ */
+void Chord::tightenStabilize() {
+    __atomic_store_n(&(this->stabilizeInterval), MIN_STABILIZE_INTERVAL, __ATOMIC_RELAXED);
+    
+    // A round in flight re-arms the timer when it is answered or missed
+    if (__atomic_load_n(&(this->substate), __ATOMIC_RELAXED) != ChordStatus::STABILIZING) {
+        this->armTimer(&(this->stabilizeTimer), MIN_STABILIZE_INTERVAL);
+    }
+}
+
+/**
+ * Implementing ThreadFactory::threadWorker() method for threading
+ * 
+ * Runs the event loop: blocks until a datagram arrives or the next timer is due,
+ * drains the socket until it would block and runs the expired timers
+ */
+void Chord::threadWorker() {
+    dprt << "Starting thread worker...";
+    struct epoll_event events[MAX_EVENTS];
+    
+    while (this->state != ChordStatus::SERVICE_CLOSING) {
+        int nready = this->reactor.wait(events, MAX_EVENTS, this->timers.timeout());
+        if (nready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            
+            dprt << "Cannot wait for events: " << strerror(errno);
+            break;
+        }
+        
+        for (int i = 0; i < nready; ++i) {
+            int fd = events[i].data.fd;
+            
+            if (this->reactor.isWakeup(fd)) {
+                // Stop requested (loop condition will handle it) or a timer is due sooner than planned
+                EventLoop::drain(fd);
+            } else if (fd == this->chord_sfd) {
+                if (events[i].events & EPOLLOUT) {
+                    // Room in the send buffer again
+                    this->drainBlockedSends();
+                    if (events[i].events == EPOLLOUT) {
+                        continue;
+                    }
+                }
+                
+                // Get new messages, a batch per call, until the socket would block
+                int count;
+                do {
+                    count = this->inbox.receive(this->chord_sfd);
+                    
+                    for (int j = 0; j < count; ++j) {
+                        if (!MessageHandler::validate(this->inbox.buffer(j), this->inbox.length(j))) {
+                            dprt << "Dropping malformed message";
+                            continue;
+                        }
+                        
+                        // Hand the buffer to the workers as is and receive into a fresh one from now on
+                        datagram *dg = this->inboxSlots[j];
+                        dg->len = this->inbox.length(j);
+                        this->inboxSlots[j] = this->datagramPool.acquire();
+                        this->inbox.attach(j, this->inboxSlots[j]->data);
+                        this->submitWork(dg);
+                    }
+                } while (count == (int) this->inbox.capacity());
+                
+                if (count == -1) {
+                    dprt << "Cannot listen to socket: " << strerror(errno);
+                    this->setErrorno(ERR_CONN_LOST);
+                    return;
+                }
+            }
+        }
+        
+        this->processTimers();
+    }
+}
+
+/**
+ * Implementing WorkerPool::processWork() method; runs on the worker threads
+ * 
+ * @param   job     A message submitted by the receiver thread
+ */
+void Chord::processWork(void *job) {
+    datagram *dg = (datagram *) job;
+    this->handleMessage(dg->data, dg->len);
+    this->datagramPool.release(dg);
+}
+
+/**
+ * Processes a single received message. May run on several worker threads at
+ * once; routing state is only read from and published as snapshots
+ * 
+ * The message is decoded in place through the views in MessageViews.hpp and
+ * replies are encoded into a stack buffer, so nothing is allocated per message
+ * other than for state that outlives it
+ * 
+ * @param   data    The received message, already checked by MessageHandler::validate
+ * @param   len     The length of data
+ */
+void Chord::handleMessage(const unsigned char *data, size_t len) {
+    // Encoded replies go here
+    unsigned char reply[MAX_DATAGRAM];
+    
+    // Process each message by type
+    unsigned int type = MessageView(data, len).getType();
+    switch (type) {
+        case MTYPE_UPDATE_PREDECESSOR:
+        {
+            dprt << "New UpdatePredcessor";
+            UpdatePredecessorView up(data, len);
+            
+            node *sender = this->getPeer(up.predecessor(), up.appPort());
+            if (sender == NULL || sender->isSelf) {
+                break;
+            }
+            this->acceptPredecessor(sender);
+            
+            // Acknowledge the update, whether or not it was taken; the sender stops resending
+            UpdatePredcessorAck upAck = MessageHandler::makeUpdatePredecessorAck(sender->hashedId);
+            this->addHints(upAck.hints, upAck.size, sender);
+            this->send(sender, reply, MessageHandler::encode(&upAck, reply, sizeof(reply)));
+            
+            break;
+        }
+        case MTYPE_UPDATE_PREDECESSOR_ACK:
+        {
+            dprt << "New UpdatePredcessorAck";
+            UpdatePredecessorAckView upAck(data, len);
+            
+            // Remove timers
+            if (upAck.hashedId() == this->hashedId) {
+                this->unsetSendTimer(upAck.hashedId());
+            }
+            this->takeHints(upAck, upAck.hints());
+            
+            break;
+        }
+        case MTYPE_STABILIZE_REQUEST:
+        {
+            dprt << "New StabilizeRequest";
+            StabilizeRequestView streq(data, len);
+            
+            node *requestor = this->getPeer(streq.sender(), streq.appPort());
+            if (requestor == NULL || requestor->isSelf) {
+                break;
+            }
+            
+            // The requestor thinks I am its successor, so it may be my predecessor
+            this->acceptPredecessor(requestor);
+            
+            // Answer with my predecessor, and my successors for its successor list
+            StabilizeResponse stres;
+            {
+                SnapshotCell<routingTable>::Reader table(this->routing);
+                node *pred = (table->predecessor != NULL) ? table->predecessor : requestor;
+                stres = MessageHandler::makeStabilizeResponse(__atomic_load_n(&(pred->appPort), __ATOMIC_RELAXED), pred->ipaddr, streq.requestId());
+                for (unsigned int i = 0; i < table->successorCount; ++i) {
+                    MessageHandler::addSuccessor(stres, __atomic_load_n(&(table->successors[i]->appPort), __ATOMIC_RELAXED), table->successors[i]->ipaddr);
+                }
+            }
+            this->addHints(stres.hints, stres.size, requestor);
+            
+            this->send(requestor, reply, MessageHandler::encode(&stres, reply, sizeof(reply)));
+            break;
+        }
+        case MTYPE_STABILIZE_RESPONSE:
+        {
+            dprt << "New StabilizeResponse";
+            
+            StabilizeResponseView stres(data, len);
+            node *succ = this->getSuccessor();
+            
+            // Proceed only with the answer to the request in flight, and only if it went to
+            // the successor I still have; a late answer from an earlier one is stale
+            uint32_t requestId = stres.requestId();
+            if (requestId != 0 && succ != NULL && !succ->isSelf
+                    && __atomic_compare_exchange_n(&(this->stabilizeRequestId), &requestId, (uint32_t) 0,
+                            false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)
+                    && __atomic_load_n(&(this->stabilizeTarget), __ATOMIC_RELAXED) == succ) {
+                vector<node *> successors;
+                
+                // If a node joined between me and my successor, it is my successor now. One
+                // I gave up on is only taken back once it answers a probe, as my successor
+                // may not have noticed yet that it is gone
+                node *x = this->getPeer(stres.predecessor(), stres.appPort());
+                if (x != NULL && !x->isSelf && x != succ
+                        && this->isInSuccessor(x->hashedId, this->hashedId, succ->hashedId)) {
+                    if (!__atomic_load_n(&(x->failed), __ATOMIC_RELAXED)) {
+                        successors.push_back(x);
+                    } else {
+                        Probe probe = MessageHandler::makeProbe((uint32_t) TimingWheel::now(), this->appPort, this->ipaddr);
+                        this->send(x, reply, MessageHandler::encode(&probe, reply, sizeof(reply)));
+                    }
+                }
+                successors.push_back(succ);
+                
+                // The rest follow my successor's successors, up to where the ring comes back to me
+                for (unsigned int i = 0; i < stres.successorCount() && successors.size() < SUCCESSOR_LIST_SIZE; ++i) {
+                    node *s = this->getPeer(stres.successorIp(i), stres.successorPort(i));
+                    if (s == NULL || s->isSelf || find(successors.begin(), successors.end(), s) != successors.end()) {
+                        break;
+                    }
+                    
+                    if (!__atomic_load_n(&(s->failed), __ATOMIC_RELAXED)) {
+                        successors.push_back(s);
+                    }
+                }
+                
+                // Stabilize often while the neighbourhood changes, and back off while it does not
+                unsigned int interval = MIN_STABILIZE_INTERVAL;
+                if (!this->setSuccessors(successors)) {
+                    interval = min(2 * __atomic_load_n(&(this->stabilizeInterval), __ATOMIC_RELAXED), MAX_STABILIZE_INTERVAL);
+                }
+                __atomic_store_n(&(this->stabilizeInterval), interval, __ATOMIC_RELAXED);
+                
+                __atomic_store_n(&(this->stabilizeMisses), 0, __ATOMIC_RELAXED);
+                this->armTimer(&(this->stabilizeTimer), interval);
+                __atomic_store_n(&(this->substate), ChordStatus::IN_NETWORK, __ATOMIC_RELAXED);
+                this->takeHints(stres, stres.hints());
+            }
+            
+            break;
+        }
+        case MTYPE_FINGER_TABLE_REQUEST:
+        {
+            dprt << "New FingerTableRequest";
+            StabilizeRequestView ftreq(data, len);
+            
+            node *requestor = this->getPeer(ftreq.sender(), ftreq.appPort());
+            if (requestor == NULL || requestor->isSelf) {
+                break;
+            }
+            
+            // Every node I route by, each once
+            vector<node *> known;
+            {
+                SnapshotCell<routingTable>::Reader table(this->routing);
+                for (unsigned int i = 0; i < table->successorCount; ++i) {
+                    known.push_back(table->successors[i]);
+                }
+                for (unsigned int i = 0; i < CHORD_LENGTH_BIT; ++i) {
+                    known.push_back(table->fingers[i]);
+                }
+            }
+            
+            // As many responses as it takes, each one a datagram
+            FingerTableResponse ftres = MessageHandler::makeFingerTableResponse(this->appPort, this->ipaddr);
+            vector<node *> sent;
+            for (unsigned int i = 0; i < known.size(); ++i) {
+                node *n = known[i];
+                if (n == NULL || n->isSelf || n == requestor || find(sent.begin(), sent.end(), n) != sent.end()) {
+                    continue;
+                }
+                
+                if (ftres.entryCount == MAX_FINGER_ENTRIES) {
+                    this->send(requestor, reply, MessageHandler::encode(&ftres, reply, sizeof(reply)));
+                    ftres = MessageHandler::makeFingerTableResponse(this->appPort, this->ipaddr);
+                }
+                
+                if (MessageHandler::addFingerEntry(ftres, __atomic_load_n(&(n->appPort), __ATOMIC_RELAXED), n->ipaddr)) {
+                    sent.push_back(n);
+                }
+            }
+            this->send(requestor, reply, MessageHandler::encode(&ftres, reply, sizeof(reply)));
+            
+            break;
+        }
+        case MTYPE_FINGER_TABLE_RESPONSE:
+        {
+            dprt << "New FingerTableResponse";
+            FingerTableResponseView ftres(data, len);
+            
+            vector<node *> candidates;
+            candidates.push_back(this->getPeer(ftres.responder(), ftres.appPort()));
+            for (unsigned int i = 0; i < ftres.entryCount(); ++i) {
+                candidates.push_back(this->getPeer(ftres.entryIp(i), ftres.entryPort(i)));
+            }
+            
+            this->adoptFingers(candidates);
+            break;
+        }
+        case MTYPE_CHORD_MAP_QUERY:
+        {
+            dprt << "New ChordMapQuery";
+            ChordMapQueryView cmq(data, len);
+            
+            if (strcmp(cmq.sender(), this->ipaddr) == 0) {
+                // Query looped back to self
+                if (this->state == ChordStatus::MAPPING_CHORD) {
+                    this->state = ChordStatus::MAPPING_COMPLETED;
+                }
+                
+                break;
+            }
+            
+            // Pass onto the successor with next sequence (used for tracking which one came first
+            node *succ = this->getSuccessor();
+            ChordMapResponse cmr = MessageHandler::makeChordMapResponse(cmq.seq() + 1, this->ipaddr);
+            if (succ == NULL) {
+                // Set sequence to 0 to indicate deadend (broken ring)
+                cmr.seq = 0;
+            }
+            
+            // Send my information back to the originator
+            node *originator = this->getPeer(cmq.sender());
+            if (originator == NULL) {
+                break;
+            }
+            this->send(originator, reply, MessageHandler::encode(&cmr, reply, sizeof(reply)));
+            
+            if (succ != NULL) {
+                ChordMapQuery next = MessageHandler::makeChordMapQuery(cmq.seq() + 1, cmq.sender());
+                this->send(succ, reply, MessageHandler::encode(&next, reply, sizeof(reply)));
+            }
+            
+            break;
+        }
+        case MTYPE_CHORD_MAP_RESPONSE:
+        {
+            dprt << "New ChordMapResponse";
+            if (this->state != ChordStatus::MAPPING_CHORD) {
+                // If I did not originate it, I should not receive a response
+                break;
+            }
+            
+            // Outlives the datagram, so it is copied out
+            ChordMapResponseView cmrView(data, len);
+            ChordMapResponse *cmr = MessageHandler::createChordMapResponse(cmrView.seq(), cmrView.responder());
+            this->pushChordMapResponse(cmr);
+            
+            if (cmrView.seq() == 0) {
+                // A deadend response
+                this->state = ChordStatus::MAPPING_COMPLETED;
+            }
+            
+            break;
+        }
+        case MTYPE_JOIN_SUCCESSOR_QUERY:
+            dprt << "New JoinSuccessorQuery";
+        case MTYPE_FINGER_QUERY:
+            dprt << "New FingerQuery";
+        case MTYPE_SUCCESSOR_QUERY:
+        {
+            dprt << "New SuccessorQuery";
+            SuccessorQueryView sq(data, len);
+            node *succ = this->getSuccessor();
+            
+            if (strcmp(sq.sender(), this->ipaddr) == 0) {
+                // Happens if the packet I sent looped back to me
+                if (type == MTYPE_FINGER_QUERY) {
+                    int i = this->getFingerIndex(sq.searchTerm());
+                    if (i >= 0) {
+                        this->setFingers((uint64_t) 1 << i, this->selfNode);
+                    }
+                } else {
+                    this->completeQuery(sq.requestId(), this->ipaddr, this->appPort);
+                }
+            } else if (succ->isSelf) {
+                // If no successor and predecessor, this is a single node or first node in chord.
+                // The requestor is joining, so the range I own is only known once I have a predecessor
+                node *pred = this->getPredecessor();
+                SuccessorResponse sr = MessageHandler::makeSuccessorResponse(
+                        sq.searchTerm(),
+                        this->appPort,
+                        this->ipaddr,
+                        sq.requestId(),
+                        (pred != NULL) ? pred->hashedId : this->hashedId
+                );
+                
+                if (type == MTYPE_FINGER_QUERY) {
+                    sr.type = MTYPE_FINGER_RESPONSE;
+                }
+                
+                node *tmp = this->getPeer(sq.sender(), sq.appPort());
+                if (tmp == NULL) {
+                    break;
+                }
+                this->setSuccessor(tmp);
+                this->send(tmp, reply, MessageHandler::encode(&sr, reply, sizeof(reply)));
+            } else if (this->isInSuccessor(sq.searchTerm(), this->hashedId, succ->hashedId)) {
+                /*
+                 * If ID satisfies successor requirement: > this id && <= successor id
+                 * If ID > my id and, successor id < my id, then this is the last node clockwise in chord
+                 * In both cases, send successor info to the requestor
+                 */
+                SuccessorResponse sr = MessageHandler::makeSuccessorResponse(
+                        sq.searchTerm(),
+                        __atomic_load_n(&(succ->appPort), __ATOMIC_RELAXED),
+                        succ->ipaddr,
+                        sq.requestId(),
+                        this->hashedId      // I am its predecessor
+                );
+                
+                if (type == MTYPE_FINGER_QUERY) {
+                    sr.type = MTYPE_FINGER_RESPONSE;
+                }
+                
+                node *requestor = this->getPeer(sq.sender(), sq.appPort());
+                if (requestor == NULL) {
+                    break;
+                }
+                this->addHints(sr.hints, sr.size, requestor);
+                this->send(requestor, reply, MessageHandler::encode(&sr, reply, sizeof(reply)));
+            } else {
+                // Forward the request to the successor; the received bytes are passed on as they are
+                if (type == MTYPE_SUCCESSOR_QUERY || type == MTYPE_JOIN_SUCCESSOR_QUERY) {
+                    if (type == MTYPE_JOIN_SUCCESSOR_QUERY) {
+                        this->send(this->getSuccessorOf(sq.searchTerm(), false), (unsigned char *) data, sq.getSize());
+                    } else {
+                        this->send(this->getSuccessorOf(sq.searchTerm(), true), (unsigned char *) data, sq.getSize());
+                    }
+                }
+            }
+            
+            break;
+        }
+        case MTYPE_NEXT_HOP_QUERY:
+        {
+            dprt << "New NextHopQuery";
+            SuccessorQueryView sq(data, len);
+            node *succ = this->getSuccessor();
+            node *requestor = this->getPeer(sq.sender(), sq.appPort());
+            if (succ == NULL || requestor == NULL || requestor->isSelf) {
+                break;
+            }
+            
+            SuccessorResponse sr;
+            if (succ->isSelf || this->isInSuccessor(sq.searchTerm(), this->hashedId, succ->hashedId)) {
+                // The owner is known, this is the last hop. I am its predecessor, unless I am
+                // alone, where I own the range after my predecessor if I have one yet
+                node *owner = succ->isSelf ? this->selfNode : succ;
+                node *pred = succ->isSelf ? this->getPredecessor() : this->selfNode;
+                sr = MessageHandler::makeSuccessorResponse(
+                        sq.searchTerm(),
+                        __atomic_load_n(&(owner->appPort), __ATOMIC_RELAXED),
+                        owner->ipaddr,
+                        sq.requestId(),
+                        (pred != NULL) ? pred->hashedId : owner->hashedId
+                );
+            } else {
+                node *next = this->getSuccessorOf(sq.searchTerm());
+                sr = MessageHandler::makeSuccessorResponse(sq.searchTerm(), __atomic_load_n(&(next->appPort), __ATOMIC_RELAXED), next->ipaddr, sq.requestId());
+                sr.type = MTYPE_NEXT_HOP_RESPONSE;
+            }
+            
+            this->addHints(sr.hints, sr.size, requestor);
+            this->send(requestor, reply, MessageHandler::encode(&sr, reply, sizeof(reply)));
+            break;
+        }
+        case MTYPE_PROBE:
+        {
+            ProbeView probe(data, len);
+            node *prober = this->getPeer(probe.sender(), probe.appPort());
+            if (prober == NULL || prober->isSelf) {
+                break;
+            }
+            
+            Probe ack = MessageHandler::makeProbe(probe.stamp(), this->appPort, this->ipaddr);
+            ack.type = MTYPE_PROBE_ACK;
+            this->send(prober, reply, MessageHandler::encode(&ack, reply, sizeof(reply)));
+            break;
+        }
+        case MTYPE_PROBE_ACK:
+        {
+            ProbeView ack(data, len);
+            this->sampleRtt(this->getPeer(ack.sender(), ack.appPort()), (uint32_t) TimingWheel::now() - ack.stamp());
+            break;
+        }
+        case MTYPE_NEXT_HOP_RESPONSE:
+        {
+            dprt << "New NextHopResponse";
+            SuccessorResponseView sr(data, len);
+            this->advanceQuery(sr.requestId(), sr.responder(), sr.appPort());
+            this->takeHints(sr, sr.hints());
+            break;
+        }
+        case MTYPE_FINGER_RESPONSE:
+        case MTYPE_SUCCESSOR_RESPONSE:
+        {   
+            //dprt << "New SuccessorResponse";
+            SuccessorResponseView sr(data, len);
+            
+            // Whoever answered knows the whole interval the responder owns, unless it said it does not
+            uint32_t owner = this->getConsistentHash(sr.responder(), strlen(sr.responder()) + 1);
+            if (sr.rangeStart() != owner) {
+                this->locations.insert(sr.rangeStart(), owner, sr.responder(), sr.appPort());
+            }
+            
+            if (type == MTYPE_FINGER_RESPONSE) {
+                int i = this->getFingerIndex(sr.searchTerm());
+                if (i < 0) {
+                    // Not one of our finger starts
+                    break;
+                }
+                
+                // A nearer node in the same interval routes as well as the one found
+                node *finger = __atomic_load_n(&(this->nearest[i]), __ATOMIC_ACQUIRE);
+                if (finger == NULL) {
+                    // Most refreshes confirm the finger we already have; only look up the peer on change
+                    node *current = this->getFinger(i);
+                    bool unchanged = current != NULL
+                            && strcmp(current->ipaddr, sr.responder()) == 0 && __atomic_load_n(&(current->appPort), __ATOMIC_RELAXED) == sr.appPort();
+                    
+                    finger = unchanged ? current : this->getPeer(sr.responder(), sr.appPort());
+                    if (finger == NULL) {
+                        break;
+                    }
+                }
+                
+                // The same node succeeds every later finger start up to it, unless a nearer one serves there
+                uint64_t which = (uint64_t) 1 << i;
+                uint32_t reach = ringDistance(this->hashedId, finger->hashedId);
+                for (unsigned int j = i + 1; j < CHORD_LENGTH_BIT && ((uint32_t) 1 << j) <= reach; ++j) {
+                    if (__atomic_load_n(&(this->nearest[j]), __ATOMIC_RELAXED) == NULL) {
+                        which |= (uint64_t) 1 << j;
+                    }
+                }
+                
+                this->setFingers(which, finger);
+            } else {
+                this->completeQuery(sr.requestId(), sr.responder(), sr.appPort());
+            }
+            this->takeHints(sr, sr.hints());
+
+            break;
+        }
+        default:
+            dprt << "Cannot identify type";
+    }
+}
+
+/**
+ * State shared between query() and the callback completing it
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    char *hostip;
+    unsigned int port;
+} syncQuery;
+
+/**
+ * QueryCallback used by query() to hand the result back to the blocked caller
+ */
+static void completeSyncQuery(uint32_t keyhash, const char *hostip, unsigned int port, void *context) {
+    syncQuery *sq = (syncQuery *) context;
+    
+    pthread_mutex_lock(&(sq->lock));
+    if (hostip != NULL) {
+        sq->hostip = new char[strlen(hostip) + 1];
+        strcpy(sq->hostip, hostip);
+        sq->port = port;
+    }
+    sq->done = true;
+    pthread_cond_signal(&(sq->cond));
+    pthread_mutex_unlock(&(sq->lock));
+}
+
+/**
+ * Start querying on the successor chains; blocks until the lookup completes
+ * 
+ * @param   key         Key to search for
+ * @param   *hostip     Pointer to a pointer to character array. This will be set to the host
+ *                      that possesses key upon function returns
+ * @param   &hostport   Indicating which port the host that possesses the key runs on
+ * @param   timeout     How long to wait for query, specified in milliseconds. Default is 0
+ * @param   mode        Recursive or iterative lookup. Default is what setLookupMode() selected
+ * @return  The key being queried
+ */
+char *Chord::query(char *key, char **hostip, unsigned int &hostport, unsigned int timeout, ChordLookup::mode mode) {
+    if (key == NULL) {
+        return NULL;
+    }
+    
+    syncQuery sq;
+    pthread_mutex_init(&(sq.lock), NULL);
+    pthread_cond_init(&(sq.cond), NULL);
+    sq.done = false;
+    sq.hostip = NULL;
+    sq.port = 0;
+    
+    if (this->queryAsync(key, completeSyncQuery, &sq, timeout, mode)) {
+        // Woken up by the worker thread that receives the response
+        pthread_mutex_lock(&(sq.lock));
+        while (!sq.done) {
+            pthread_cond_wait(&(sq.cond), &(sq.lock));
+        }
+        pthread_mutex_unlock(&(sq.lock));
+        
+        if (sq.hostip != NULL) {
+            *hostip = sq.hostip;
+            hostport = sq.port;
+            dprt << "Setting hostip to " << *hostip << " and port to " << hostport;
+        } else {
+            this->setErrorno(ERR_QUERY_TIMEOUT);
+        }
+    }
+    
+    pthread_cond_destroy(&(sq.cond));
+    pthread_mutex_destroy(&(sq.lock));
+    
+    return key;
+}
+
+/**
+ * Starts looking up the node responsible for key without blocking. The callback
+ * is invoked exactly once: with the owner when the matching SuccessorResponse
+ * arrives, or with a NULL hostip once timeout passes or the service stops
+ * 
+ * @param   key         Key to search for
+ * @param   callback    Called when the lookup completes, see QueryCallback
+ * @param   context     Passed to callback as is
+ * @param   timeout     How long to wait for the response, in milliseconds. Default 0 waits until the lookup is given up on after its last resend
+ * @param   mode        Recursive or iterative lookup. Default is what setLookupMode() selected
+ * @return  True if the lookup was started (callback will be called), false
+ *          otherwise and sets ChordError number
+ */
+bool Chord::queryAsync(char *key, QueryCallback callback, void *context, unsigned int timeout, ChordLookup::mode mode) {
+    if (key == NULL || callback == NULL) {
+        this->setErrorno(ERR_INVALID_KEY);
+        return false;
+    }
+    
+    if (!inService(this->state)) {
+        // Nothing would answer or expire the lookup
+        this->setErrorno(ERR_NOT_IN_SERVICE);
+        return false;
+    }
+    
+    datagram query;
+    node *sendto = this->startQuery(this->getConsistentHash(key, strlen(key) + 1), callback, context, timeout, &query, mode);
+    if (sendto != NULL) {
+        this->send(sendto, query.data, query.len);
+    }
+    
+    return true;
+}
+
+/**
+ * State shared between queryBatch() and the callbacks completing its lookups
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned int remaining;
+} batchQuery;
+
+typedef struct {
+    batchQuery *batch;
+    QueryResult *result;
+} batchSlot;
+
+/**
+ * QueryCallback used by queryBatch() to fill in one result
+ */
+static void completeBatchQuery(uint32_t keyhash, const char *hostip, unsigned int port, void *context) {
+    batchSlot *slot = (batchSlot *) context;
+    
+    // Each slot is completed exactly once, only the counter is shared
+    if (hostip != NULL) {
+        slot->result->hostip = new char[strlen(hostip) + 1];
+        strcpy(slot->result->hostip, hostip);
+        slot->result->port = port;
+    }
+    
+    pthread_mutex_lock(&(slot->batch->lock));
+    if (--(slot->batch->remaining) == 0) {
+        pthread_cond_signal(&(slot->batch->cond));
+    }
+    pthread_mutex_unlock(&(slot->batch->lock));
+}
+
+/**
+ * Looks up the nodes responsible for many keys at once. Keys in the successor
+ * range are resolved locally; the queries for all others are sent back to back
+ * (IO_BATCH per system call) and answered concurrently. Blocks until every key
+ * is resolved or timed out
+ * 
+ * @param   keys        Keys to search for
+ * @param   timeout     How long to wait for each response, in milliseconds. Default 0 waits until the lookup is given up on after its last resend
+ * @param   mode        Recursive or iterative lookup. Default is what setLookupMode() selected
+ * @return  One result per key, in the order of keys. hostip is NULL for keys that
+ *          could not be resolved, and for all of them with ChordError number set
+ *          if the service is not running; otherwise it must be freed with delete[]
+ */
+vector<QueryResult> Chord::queryBatch(const vector<char *> &keys, unsigned int timeout, ChordLookup::mode mode) {
+    vector<QueryResult> results(keys.size());
+    for (unsigned int i = 0; i < keys.size(); ++i) {
+        results[i].key = keys[i];
+        results[i].hostip = NULL;
+        results[i].port = 0;
+    }
+    
+    if (!inService(this->state)) {
+        this->setErrorno(ERR_NOT_IN_SERVICE);
+        return results;
+    }
+    
+    vector<batchSlot> slots(keys.size());
+    
+    batchQuery bq;
+    pthread_mutex_init(&(bq.lock), NULL);
+    pthread_cond_init(&(bq.cond), NULL);
+    bq.remaining = keys.size();
+    
+    for (unsigned int i = 0; i < keys.size(); ++i) {
+        slots[i].batch = &bq;
+        slots[i].result = &(results[i]);
+    }
+    
+    vector<unsigned int> keyhashes = this->getHashedKeys(keys);
+    
+    // Queries waiting to be sent; the datagrams are released once flushed
+    SendBatch pipeline(IO_BATCH);
+    vector<datagram *> encoded;
+    
+    for (unsigned int i = 0; i < keys.size(); ++i) {
+        if (keys[i] == NULL) {
+            completeBatchQuery(0, NULL, 0, &(slots[i]));
+            continue;
+        }
+        
+        datagram *query = this->datagramPool.acquire();
+        node *sendto = this->startQuery(
+                keyhashes[i],
+                completeBatchQuery,
+                &(slots[i]),
+                timeout,
+                query,
+                mode
+        );
+        
+        if (sendto == NULL || sendto->addr == NULL || !this->admitSend(sendto, query->data, query->len)) {
+            this->datagramPool.release(query);
             continue;
         }
+        
+        pipeline.add(sendto->addr, sendto->len, query->data, query->len);
+        encoded.push_back(query);
+        
+        if (pipeline.full()) {
+            this->flushQueries(pipeline, encoded);
+        }
+    }
+    this->flushQueries(pipeline, encoded);
+    
+    pthread_mutex_lock(&(bq.lock));
+    while (bq.remaining > 0) {
+        pthread_cond_wait(&(bq.cond), &(bq.lock));
+    }
+    pthread_mutex_unlock(&(bq.lock));
+    
+    pthread_cond_destroy(&(bq.cond));
+    pthread_mutex_destroy(&(bq.lock));
+    
+    return results;
+}
+
+/**
+ * Sends the queries pipelined by queryBatch() and releases their datagrams
+ * 
+ * @param   pipeline    The queued queries
+ * @param   encoded     The datagrams holding them
+ */
+void Chord::flushQueries(SendBatch &pipeline, vector<datagram *> &encoded) {
+    // Lost ones are left to the retransmit timers
+    this->flushBatch(pipeline);
+    
+    for (unsigned int i = 0; i < encoded.size(); ++i) {
+        this->datagramPool.release(encoded[i]);
+    }
+    encoded.clear();
+}
+
+/**
+ * Registers a lookup of keyhash and prepares its SuccessorQuery. Keys in the
+ * successor range complete immediately, on the calling thread
+ * 
+ * A recursive lookup sends a SuccessorQuery that is forwarded hop by hop until
+ * it reaches the owner's predecessor, which answers. An iterative lookup sends
+ * a NextHopQuery to each hop in turn: the hop answers itself, with the owner if
+ * it is its successor or else with its closest preceding finger to ask next
+ * 
+ * @param   keyhash     Hash of the key to search for
+ * @param   callback    Called when the lookup completes
+ * @param   context     Passed to callback as is
+ * @param   timeout     How long to wait for the response, in milliseconds. 0 waits until the lookup is given up on after its last resend
+ * @param   query       Receives the encoded query if one needs to be sent
+ * @param   mode        Recursive or iterative lookup
+ * @return  The node to send query to; NULL if nothing needs to be sent
+ */
+node *Chord::startQuery(uint32_t keyhash, QueryCallback callback, void *context, unsigned int timeout, datagram *query,
+        ChordLookup::mode mode) {
+    node *succ = this->getSuccessor();
+    if (succ == NULL || succ->isSelf) {
+        callback(keyhash, this->ipaddr, this->appPort, context);
+        return NULL;
+    }
+    
+    // If this successor may have it
+    if (this->isInSuccessor(keyhash, this->hashedId, succ->hashedId)) {
+        callback(keyhash, succ->ipaddr, __atomic_load_n(&(succ->appPort), __ATOMIC_RELAXED), context);
+        return NULL;
+    }
+    
+    // Or if a recent lookup already found who does
+    char ownerIp[INET6_ADDRSTRLEN];
+    unsigned int ownerPort;
+    if (this->locations.lookup(keyhash, ownerIp, ownerPort)) {
+        callback(keyhash, ownerIp, ownerPort, context);
+        return NULL;
+    }
+    
+    pendingQuery *pq = this->queryPool.acquire();
+    pq->keyhash = keyhash;
+    pq->callback = callback;
+    pq->context = context;
+    pq->iterative = (mode == ChordLookup::DEFAULT ? this->lookupMode : mode) == ChordLookup::ITERATIVE;
+    pq->hops = 1;
+    pq->retries = 0;
+    pq->sentAt = TimingWheel::now();
+    
+    pthread_mutex_lock(&(this->pendingQueryMutex));
+    // 0 is left for messages nobody waits for
+    do {
+        pq->requestId = this->nextRequestId++;
+    } while (pq->requestId == 0 || this->pendingQueries.count(pq->requestId) > 0);
+    pthread_mutex_unlock(&(this->pendingQueryMutex));
+    
+    // If the successor does not have it, forward it to the successor and let him deal with it
+    node *sendto = this->getSuccessorOf(keyhash);
+    SuccessorQuery sq = MessageHandler::makeSuccessorQuery(keyhash, this->appPort, this->ipaddr, pq->requestId);
+    if (pq->iterative) {
+        sq.type = MTYPE_NEXT_HOP_QUERY;
+    }
+    query->len = MessageHandler::encode(&sq, query->data, sizeof(query->data));
+    
+    // The lookup keeps its own copy to retransmit
+    pq->recipient = sendto;
+    pq->query.len = query->len;
+    memcpy(pq->query.data, query->data, query->len);
+    TimingWheel::initTimer(&(pq->resend), ChordTimer::LOOKUP_RESEND, pq->requestId);
+    TimingWheel::initTimer(&(pq->deadline), ChordTimer::LOOKUP_DEADLINE, pq->requestId);
+    
+    // Register before sending, the response may arrive before send() returns
+    pthread_mutex_lock(&(this->pendingQueryMutex));
+    this->pendingQueries[pq->requestId] = pq;
+    this->armTimer(&(pq->resend), pq->iterative
+            ? this->getRto(sendto, HOP_TIMEOUT, 0)
+            : retransmitTimeout(this->lookupSrtt, this->lookupRttvar, SEND_TIMEOUT, 0));
+    if (timeout != 0) {
+        this->armTimer(&(pq->deadline), timeout * 1000);
+    }
+    pthread_mutex_unlock(&(this->pendingQueryMutex));
+    
+    return sendto;
+}
+
+/**
+ * Completes the pending lookup with the given request ID, if it is still pending
+ * 
+ * @param   requestId   The requestId of the received SuccessorResponse
+ * @param   hostip      IP address of the responsible node
+ * @param   port        Application port of the responsible node
+ */
+void Chord::completeQuery(uint32_t requestId, const char *hostip, unsigned int port) {
+    pendingQuery *pq = NULL;
+    uint32_t elapsed = 0;
+    
+    pthread_mutex_lock(&(this->pendingQueryMutex));
+    unordered_map<uint32_t, pendingQuery *>::iterator it = this->pendingQueries.find(requestId);
+    if (it != this->pendingQueries.end()) {
+        pq = it->second;
+        this->pendingQueries.erase(it);
+        this->timers.cancel(&(pq->resend));
+        this->timers.cancel(&(pq->deadline));
+        
+        // Answers to resent queries are ambiguous, and failures are no answers
+        elapsed = TimingWheel::now() - pq->sentAt;
+        if (hostip != NULL && pq->retries == 0 && !pq->iterative) {
+            updateRtt(this->lookupSrtt, this->lookupRttvar, elapsed);
+        }
+    }
+    pthread_mutex_unlock(&(this->pendingQueryMutex));
+    
+    if (pq == NULL) {
+        // Late duplicate of an answered or expired lookup
+        dprt << "No pending lookup for request " << requestId;
+        return;
+    }
+    
+    if (hostip != NULL && pq->retries == 0 && pq->iterative) {
+        // The last hop answered
+        this->sampleRtt(pq->recipient, elapsed);
+    }
+    
+    // Callback runs without holding the lock, it may start new lookups
+    pq->callback(pq->keyhash, hostip, port, pq->context);
+    this->queryPool.release(pq);
+}
+
+/**
+ * Moves an iterative lookup on to the next hop
+ * 
+ * @param   requestId   The requestId of the received NextHopResponse
+ * @param   hostip      IP address of the next node to ask
+ * @param   port        Application port of the next node to ask
+ */
+void Chord::advanceQuery(uint32_t requestId, const char *hostip, unsigned int port) {
+    node *next = this->getPeer(hostip, port);
+    
+    datagram query;
+    query.len = 0;
+    bool failed = false;
+    // The hop that answered, if its round trip time can be sampled
+    node *hop = NULL;
+    uint32_t elapsed = 0;
+    
+    pthread_mutex_lock(&(this->pendingQueryMutex));
+    unordered_map<uint32_t, pendingQuery *>::iterator it = this->pendingQueries.find(requestId);
+    if (it != this->pendingQueries.end() && it->second->iterative) {
+        pendingQuery *pq = it->second;
+        uint64_t now = TimingWheel::now();
+        if (pq->retries == 0) {
+            hop = pq->recipient;
+            elapsed = now - pq->sentAt;
+        }
+        
+        if (next != NULL && next->isSelf) {
+            // The hop thinks I am closest; go on from what I know
+            next = this->getSuccessorOf(pq->keyhash);
+        }
+        
+        if (next == NULL || next->isSelf || ++(pq->hops) > MAX_LOOKUP_HOPS) {
+            failed = true;
+        } else {
+            pq->recipient = next;
+            pq->retries = 0;
+            pq->sentAt = now;
+            this->timers.schedule(&(pq->resend), this->getRto(next, HOP_TIMEOUT, 0));
+            
+            // Every hop gets the same query
+            query.len = pq->query.len;
+            memcpy(query.data, pq->query.data, query.len);
+        }
+    }
+    pthread_mutex_unlock(&(this->pendingQueryMutex));
+    
+    this->sampleRtt(hop, elapsed);
+    
+    if (failed) {
+        dprt << "Lookup " << requestId << " is not getting anywhere";
+        this->completeQuery(requestId, NULL, 0);
+    } else if (query.len > 0) {
+        this->send(next, query.data, query.len);
+    }
+}
+
+/**
+ * Fails a lookup whose deadline has passed
+ * 
+ * @param   requestId   The lookup to fail
+ */
+void Chord::expireQuery(uint32_t requestId) {
+    this->completeQuery(requestId, NULL, 0);
+}
+
+/**
+ * Fails every pending lookup (used when stopping)
+ */
+void Chord::expireQueries() {
+    vector<pendingQuery *> expired;
+    
+    pthread_mutex_lock(&(this->pendingQueryMutex));
+    for (unordered_map<uint32_t, pendingQuery *>::iterator it = this->pendingQueries.begin(); it != this->pendingQueries.end(); ++it) {
+        this->timers.cancel(&(it->second->resend));
+        this->timers.cancel(&(it->second->deadline));
+        expired.push_back(it->second);
+    }
+    this->pendingQueries.clear();
+    pthread_mutex_unlock(&(this->pendingQueryMutex));
+    
+    for (unsigned int i = 0; i < expired.size(); ++i) {
+        expired[i]->callback(expired[i]->keyhash, NULL, 0, expired[i]->context);
+        this->queryPool.release(expired[i]);
+    }
+}
+
+/**
+ * Receives the next pending message. The socket is non-blocking; if nothing is
+ * pending and a timeout is specified, waits up to timeout for a datagram
+ * 
+ * @param   &size       Will be set to received size on return; -2 if nothing
+ *                      arrived (socket drained or timed out), -1 on error
+ * @param   timeout     How long to wait for, in milliseconds. Default 0 does not wait
+ * @return  Pointer to the received message format (already unserialized)
+ */
+void *Chord::receiveMessage(int &size, unsigned int timeout) {
+    // For storing things
+    unsigned char buffer[MAX_DATAGRAM];
+    
+    size = recvfrom(this->chord_sfd, buffer, MAX_DATAGRAM, 0, NULL, 0);
+    if (size == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && timeout > 0) {
+        // Nothing pending yet, wait for the socket to become readable
+        struct pollfd pfd = {this->chord_sfd, POLLIN, 0};
+        if (poll(&pfd, 1, timeout) > 0) {
+            size = recvfrom(this->chord_sfd, buffer, MAX_DATAGRAM, 0, NULL, 0);
+        }
+    }
+    
+    if (size == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // Drained or timed out, set size to -2
+            size = -2;
+            return NULL;
+        }
+        
+        dprt << "Cannot receive: " << strerror(errno);
+        this->setErrorno(ERR_CONN_LOST);
+        return NULL;
+    } else if (size == 0 || !MessageHandler::validate(buffer, size)) {
+        return NULL;
+    }
+    
+    // Unserialze and return message
+    return MessageHandler::unserialize(buffer);
+}
+
+/**
+ * Return self's ID
+ * 
+ * @return  Integer indicating the calculated ID
+ */
+unsigned int Chord::getHashedId() {
+    return this->hashedId;
+}
+
+/**
+ * Return hashed data of parametre
+ * 
+ * @param   key     Key to hash
+ * @return  Integer indicating the hashed value
+ */
+unsigned int Chord::getHashedKey(char *key){
+    if (key == NULL) {
+        this->setErrorno(ERR_INVALID_KEY);
+        return 0;
+    }
+    
+    return this->getConsistentHash(key, strlen(key) + 1);
+}
+
+/**
+ * Calculates the hashes of many keys at once; the same as calling
+ * getHashedKey() on each, but several keys are hashed in parallel
+ * 
+ * @param   keys    The keys to hash
+ * @return  The hash of each key, in the same order; 0 for NULL keys
+ */
+vector<unsigned int> Chord::getHashedKeys(const vector<char *> &keys) {
+    vector<unsigned int> ids(keys.size(), 0);
+    vector<const char *> present;
+    vector<size_t> lens;
+    vector<unsigned int> where;
+    
+    for (unsigned int i = 0; i < keys.size(); ++i) {
+        if (keys[i] != NULL) {
+            present.push_back(keys[i]);
+            lens.push_back(strlen(keys[i]) + 1);
+            where.push_back(i);
+        }
+    }
+    
+    if (present.empty()) {
+        return ids;
+    }
+    
+    vector<uint32_t> hashed(present.size());
+    this->getConsistentHashes(&(present[0]), &(lens[0]), present.size(), &(hashed[0]));
+    for (unsigned int i = 0; i < hashed.size(); ++i) {
+        ids[where[i]] = hashed[i];
+    }
+    
+    return ids;
+}
+
+/**
+ * Return the successor
+ * 
+ * @return  Successor node structure. NULL if no successor
+ */
+node *Chord::getSuccessor() {
+    SnapshotCell<routingTable>::Reader table(this->routing);
+    return (table->successorCount > 0) ? table->successors[0] : NULL;
+}
+
+/**
+ * Return the predecessor
+ * 
+ * @return  Predecessor node structure. NULL if no predecessor yet
+ */
+node *Chord::getPredecessor() {
+    SnapshotCell<routingTable>::Reader table(this->routing);
+    return table->predecessor;
+}
+
+/**
+ * Return a finger
+ * 
+ * @param   i   The finger number
+ * @return  The successor of fingerStart[i]. NULL if not known yet
+ */
+node *Chord::getFinger(unsigned int i) {
+    SnapshotCell<routingTable>::Reader table(this->routing);
+    return table->fingers[i];
+}
+
+/**
+ * Replaces the successor, keeping the rest of the successor list behind it.
+ * The node must be fully set up, as other threads may start using it as soon
+ * as this returns
+ * 
+ * @param   n   The new successor; this node if it is alone, NULL if there is none
+ */
+void Chord::setSuccessor(node *n) {
+    vector<node *> successors;
+    if (n != NULL) {
+        successors.push_back(n);
+    }
+    
+    if (n != NULL && !n->isSelf) {
+        SnapshotCell<routingTable>::Reader table(this->routing);
+        for (unsigned int i = 0; i < table->successorCount && successors.size() < SUCCESSOR_LIST_SIZE; ++i) {
+            if (table->successors[i] != n && !table->successors[i]->isSelf) {
+                successors.push_back(table->successors[i]);
+            }
+        }
+    }
+    
+    this->setSuccessors(successors);
+}
+
+/**
+ * Replaces the whole successor list
+ * 
+ * @param   successors  The successors, nearest first; at most SUCCESSOR_LIST_SIZE are kept
+ * @return  True if the list changed
+ */
+bool Chord::setSuccessors(const vector<node *> &successors) {
+    routingTable *table = this->routing.edit();
+    node *old = (table->successorCount > 0) ? table->successors[0] : NULL;
+    
+    bool changed = successors.size() != table->successorCount;
+    table->successorCount = 0;
+    for (unsigned int i = 0; i < successors.size() && i < SUCCESSOR_LIST_SIZE; ++i) {
+        changed = changed || table->successors[i] != successors[i];
+        table->successors[table->successorCount++] = successors[i];
+    }
+    
+    if (!changed) {
+        this->routing.discard(table);
+        return false;
+    }
+    this->routing.publish(table);
+    
+    // Whatever was known about the IDs between me and the new successor may be stale
+    node *n = successors.empty() ? NULL : successors[0];
+    if (n != NULL && n != old && !n->isSelf) {
+        this->locations.invalidate(this->hashedId, n->hashedId);
+    }
+    
+    return true;
+}
+
+/**
+ * Takes the predecessor a node claims to be, if it is closer than the one I know
+ * 
+ * @param   n   The node that notified me
+ * @return  True if it became my predecessor
+ */
+bool Chord::acceptPredecessor(node *n) {
+    node *pred = this->getPredecessor();
+    uint64_t now = TimingWheel::now();
+    if (pred == n) {
+        __atomic_store_n(&(this->predecessorSeen), now, __ATOMIC_RELAXED);
+        __atomic_store_n(&(this->predecessorProbed), (uint64_t) 0, __ATOMIC_RELAXED);
+        return false;
+    }
+    
+    if (pred != NULL && !__atomic_load_n(&(pred->failed), __ATOMIC_RELAXED)
+            && ringDistance(pred->hashedId, n->hashedId) >= ringDistance(pred->hashedId, this->hashedId)) {
+        // Not between my predecessor and me. Either n is behind, or my predecessor
+        // is gone and n took over from it; a probe tells which, before the next round.
+        // One I already gave up on is replaced at once
+        uint64_t idle = 0;
+        if (__atomic_compare_exchange_n(&(this->predecessorProbed), &idle, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            unsigned char buffer[MAX_DATAGRAM];
+            Probe probe = MessageHandler::makeProbe((uint32_t) now, this->appPort, this->ipaddr);
+            this->send(pred, buffer, MessageHandler::encode(&probe, buffer, sizeof(buffer)));
+            this->tightenStabilize();
+        }
+        return false;
+    }
+    
+    this->setPredecessor(n);
+    __atomic_store_n(&(this->predecessorSeen), now, __ATOMIC_RELAXED);
+    __atomic_store_n(&(this->predecessorProbed), (uint64_t) 0, __ATOMIC_RELAXED);
+    this->tightenStabilize();
+    
+    // Notify the implementing application about the change, have to move files
+    this->pushNotification(new ChordNotification(
+            ChordNotification::NTYPE_SYNC_NOTIFICATION,
+            n->ipaddr,
+            __atomic_load_n(&(n->appPort), __ATOMIC_RELAXED)
+    ));
+    
+    return true;
+}
+
+/**
+ * Forgets a node that stopped responding: it leaves the successor list, the
+ * fingers and the predecessor. If it was the successor, the next one in the
+ * list takes over at once
+ * 
+ * @param   n   The unresponsive node
+ */
+void Chord::failPeer(node *n) {
+    if (n == NULL || n->isSelf) {
+        return;
+    }
+    
+    routingTable *table = this->routing.edit();
+    bool changed = false;
+    
+    unsigned int kept = 0;
+    for (unsigned int i = 0; i < table->successorCount; ++i) {
+        if (table->successors[i] != n) {
+            table->successors[kept++] = table->successors[i];
+        }
+    }
+    
+    if (kept != table->successorCount) {
+        changed = true;
+        if (kept == 0) {
+            // Nobody left I know of; stabilize will pick up the predecessor
+            table->successors[kept++] = this->selfNode;
+        }
+        table->successorCount = kept;
     }
     
-    // Cancel timer
-    this->unsetSendTimer(keyhash);
+    if (table->predecessor == n) {
+        table->predecessor = NULL;
+        changed = true;
+    }
     
-    if (sr != NULL) {
-        if (sr->responder != NULL) {
-            delete[] sr->responder;
+    for (unsigned int i = 0; i < CHORD_LENGTH_BIT; ++i) {
+        if (table->fingers[i] == n) {
+            table->fingers[i] = NULL;
+            changed = true;
         }
         
-        delete sr;
+        // Until it answers a probe again, it is no candidate for any finger
+        node *expected = n;
+        __atomic_compare_exchange_n(&(this->nearest[i]), &expected, (node *) NULL, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
     }
+    __atomic_store_n(&(n->rttSeen), (uint64_t) 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&(n->failed), true, __ATOMIC_RELAXED);
     
-    delete[] serialized;
-    delete sq;
+    // Keys it owned belong to someone else now, whether or not I routed by it
+    this->locations.invalidateOwner(n->ipaddr);
     
-    return key;
+    if (!changed) {
+        this->routing.discard(table);
+        return;
+    }
+    this->routing.publish(table);
+    this->tightenStabilize();
 }
 
 /**
- * Wait for new message (blocking)
+ * Replaces the predecessor. The node must be fully set up, as other
+ * threads may start using it as soon as this returns
  * 
- * @param   &size       Will be set to received size on return
- * @param   timeout     How long to wait for, in milliseconds
- * @return  Pointer to the received message format (already unserialized)
+ * @param   n   The new predecessor
  */
-void *Chord::receiveMessage(int &size, unsigned int timeout) {
-    // For storing things
-    unsigned char *buffer = new unsigned char [1024];
-    // Calculate timeout if specified
-    struct timeval tv = {timeout / 1000, (timeout - (timeout / 1000) * 1000) * 1000};
-    // Populate fd_sets for select
-    fd_set readfds, exceptfds;
-    FD_SET(this->chord_sfd, &readfds);
-    exceptfds = readfds;
-    
-    // Select on socket fds for given timeout
-    int ret = select(this->chord_sfd + 1, &readfds, NULL, &exceptfds, &tv);
-    if (ret == 0) {
-        // Timeout, set size to -2
-        size = -2;
-        return NULL;
-    } else {
-        // Try to receive
-        size = recvfrom(this->chord_sfd, buffer, 1024, 0, NULL, 0);
-
-        if (size == -1) {
-            dprt << "Cannot receive: " << strerror(errno);
-            this->setErrorno(ERR_CONN_LOST);
-            return NULL;
-        } else if (size == 0) {
-            return NULL;
-        }
+void Chord::setPredecessor(node *n) {
+    routingTable *table = this->routing.edit();
+    node *old = table->predecessor;
+    if (n == old) {
+        this->routing.discard(table);
+        return;
     }
     
-    // Unserialze and return message
-    void *retval = MessageHandler::unserialize(buffer);
-    delete[] buffer;
+    table->predecessor = n;
+    this->routing.publish(table);
     
-    return retval;
+    // The IDs I own now may have been cached as someone else's
+    if (n != NULL && n != old) {
+        this->locations.invalidate(n->hashedId, this->hashedId);
+    }
 }
 
 /**
- * Return self's ID
+ * Sets how lookups are routed when the query does not say. Default is recursive
  * 
- * @return  Integer indicating the calculated ID
+ * @param   mode    ChordLookup::RECURSIVE or ChordLookup::ITERATIVE
  */
-unsigned int Chord::getHashedId() {
-    return this->hashedId;
+void Chord::setLookupMode(ChordLookup::mode mode) {
+    this->lookupMode = (mode == ChordLookup::DEFAULT) ? ChordLookup::RECURSIVE : mode;
 }
 
 /**
- * Return hashed data of parametre
+ * Points fingers at a node, publishing them at once
  * 
- * @param   key     Key to hash
- * @return  Integer indicating the hashed value
+ * @param   which   Bit i set for every finger i to update
+ * @param   n       The new finger
  */
-unsigned int Chord::getHashedKey(char *key){
-    if (key == NULL) {
-        this->setErrorno(ERR_INVALID_KEY);
-        return 0;
+void Chord::setFingers(uint64_t which, node *n) {
+    if (which == 0) {
+        return;
     }
     
-    return this->getConsistentHash(key, strlen(key) + 1);
+    routingTable *table = this->routing.edit();
+    bool changed = false;
+    for (unsigned int i = 0; i < CHORD_LENGTH_BIT; ++i) {
+        if ((which & ((uint64_t) 1 << i)) != 0 && table->fingers[i] != n) {
+            table->fingers[i] = n;
+            changed = true;
+        }
+    }
+    
+    if (changed) {
+        this->routing.publish(table);
+    } else {
+        this->routing.discard(table);
+    }
 }
 
 /**
- * Return the successor
+ * Sets the IP of the host to join Chord network from
  * 
- * @return  Successor node structure. NULL if no successor
+ * @param   toJoin  The IP address of the host to join. A host name is resolved here,
+ *                  once, since the ring only knows nodes by IP address.
+ *                  If NULL, starts a new Chord network with only this node
  */
-node *Chord::getSuccessor() {
-    return this->successor;
+void Chord::setJoinPointIp(char *toJoin) {
+    this->joinPointIp = toJoin;
+    
+    struct in_addr addr;
+    if (toJoin != NULL && inet_pton(AF_INET, toJoin, &addr) != 1) {
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        
+        if (getaddrinfo(toJoin, NULL, &hints, &res) == 0) {
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &(((struct sockaddr_in *) res->ai_addr)->sin_addr), ip, sizeof(ip));
+            this->joinPointIp = cstr(ip);
+            freeaddrinfo(res);
+        }
+    }
 }
 
 /**
- * Sets the IP of the host to join Chord network from
+ * Sets how many worker threads process received messages. Must be called before start()
  * 
- * @param   toJoin  The IP address of the host to join.
- *                  If NULL, starts a new Chord network with only this node
+ * @param   count   Number of workers. 0 processes messages on the receiver thread
  */
-void Chord::setJoinPointIp(char *toJoin) {
-    this->joinPointIp = toJoin;
+void Chord::setWorkerThreads(unsigned int count) {
+    this->workerThreads = count;
 }
 
 /**
@@ -674,22 +2343,26 @@ bool Chord::join() {
     
     if (this->joinPointIp == NULL || strcmp(this->joinPointIp, this->ipaddr) == 0) {
         // If ipaddr == NULL or == self, create new Chord ring
-        this->successor = this->createNode();
+        this->setSuccessor(this->selfNode);
     } else {
         // Construct successor request
-        SuccessorQuery *squery = MessageHandler::createSuccessorQuery(this->hashedId, this->appPort, this->ipaddr);
-        squery->type = MTYPE_JOIN_SUCCESSOR_QUERY;
-        unsigned char *serializedData = MessageHandler::serialize(squery);
+        unsigned char serializedData[MAX_DATAGRAM];
+        SuccessorQuery squery = MessageHandler::makeSuccessorQuery(this->hashedId, this->appPort, this->ipaddr);
+        squery.type = MTYPE_JOIN_SUCCESSOR_QUERY;
+        MessageHandler::encode(&squery, serializedData, sizeof(serializedData));
 
         // Create a node struct for sending, using the receiver's ipaddress
-        node *sendto = this->createNode(this->joinPointIp);
+        node *sendto = this->getPeer(this->joinPointIp);
+        if (sendto == NULL) {
+            return false;
+        }
         
         void *msg = NULL;
         unsigned int timeoutCount = 0;
         
         // Try to join for JOIN_TRIALS times
         while (timeoutCount < JOIN_TRIALS) {
-            this->send(sendto, serializedData, squery->size);
+            this->send(sendto, serializedData, squery.size);
             
             int recvd = 0;
             msg = this->receiveMessage(recvd, 1500);
@@ -705,7 +2378,7 @@ bool Chord::join() {
                 cerr << "Socket was closed" << endl;
                 return false;
             } else {
-                if (MessageHandler::getType(msg) != MTYPE_SUCCESSOR_RESPONSE) {
+                if (msg == NULL || MessageHandler::getType(msg) != MTYPE_SUCCESSOR_RESPONSE) {
                     continue;   // Ignore if not expected type
                 }
 
@@ -723,19 +2396,18 @@ bool Chord::join() {
         // Received a proper response;
         SuccessorResponse *sr = (SuccessorResponse *) msg;
         if (sr->responder == NULL) {
-            this->successor = NULL;
+            this->setSuccessor(NULL);
         } else {
-            this->successor = this->createNode(sr->responder);
-            this->successor->appPort = sr->appPort;
+            this->setSuccessor(this->getPeer(sr->responder, sr->appPort));
         }
         
-        delete squery;
-        delete sendto;
+        delete[] sr->responder;
         delete sr;
     }
     
     this->state = ChordStatus::IN_NETWORK;
     this->notifySuccessor();
+    this->requestFingerTable(this->getSuccessor());
     return true;
 }
 
@@ -743,75 +2415,132 @@ bool Chord::join() {
  * Notifies the successor of this node about the changing predecessor
  */
 void Chord::notifySuccessor() {
-    if (this->successor != NULL && !this->successor->isSelf) {
-        UpdatePredcessor *up = MessageHandler::createUpdatePredecessor(this->appPort, this->ipaddr);
-        unsigned char *serialized = MessageHandler::serialize(up);
+    node *succ = this->getSuccessor();
+    if (succ != NULL && !succ->isSelf) {
+        unsigned char serialized[MAX_DATAGRAM];
+        UpdatePredcessor up = MessageHandler::makeUpdatePredecessor(this->appPort, this->ipaddr);
+        MessageHandler::encode(&up, serialized, sizeof(serialized));
+        
+        this->send(succ, serialized, up.size);
+        this->pushSendTimer(succ, this->hashedId, serialized, up.size);
+    }
+}
+
+/**
+ * Returns the peer with the given IP address, creating it the first time the
+ * address is seen. Peers live as long as the service, so the returned node can
+ * be kept and shared freely
+ * 
+ * @param   ipaddr  The IP address of the peer
+ * @param   appPort The application port of the peer, if known; 0 keeps what was known
+ * @return  The peer; NULL if it cannot be created, and sets ChordError number
+ */
+node *Chord::getPeer(const char *ipaddr, unsigned int appPort) {
+    if (ipaddr == NULL || strcmp(ipaddr, this->ipaddr) == 0) {
+        return this->selfNode;
+    }
+    
+    node *peer = NULL;
+    
+    pthread_rwlock_rdlock(&(this->peerLock));
+    map<string, node *>::iterator it = this->peers.find(ipaddr);
+    if (it != this->peers.end()) {
+        peer = it->second;
+    }
+    pthread_rwlock_unlock(&(this->peerLock));
+    
+    if (peer == NULL) {
+        // Set up outside the lock, losing a race only costs a pool object
+        node *n = this->createNode(ipaddr);
+        if (n == NULL) {
+            return NULL;
+        }
+        
+        // Have a name ready by the time the peer is displayed
+        this->names.prefetch(ipaddr);
         
-        this->send(this->successor, serialized, up->size);
-        this->pushSendTimer(this->successor, this->hashedId, serialized, up->size);
+        pthread_rwlock_wrlock(&(this->peerLock));
+        pair<map<string, node *>::iterator, bool> ins = this->peers.insert(make_pair(string(ipaddr), n));
+        peer = ins.first->second;
+        pthread_rwlock_unlock(&(this->peerLock));
+        
+        if (!ins.second) {
+            this->nodePool.release(n);
+        }
     }
+    
+    if (appPort != 0 && __atomic_load_n(&(peer->appPort), __ATOMIC_RELAXED) != appPort) {
+        // The peer restarted with another application port
+        __atomic_store_n(&(peer->appPort), appPort, __ATOMIC_RELAXED);
+    }
+    
+    return peer;
 }
 
 /**
- * Creates a new node structure using the IP address. Also sets up UDP socket for this node
- * The port will be fixed for the same chord network, so the own chordPort will be used
+ * Creates a new node structure using the IP address
+ * The port will be fixed for the same chord network, so the own chordPort will be used.
+ * Never touches DNS; the address must be numeric
+ * 
+ * Only used to set up selfNode and the peers in the peer table; everything else
+ * should get nodes from getPeer()
  * 
  * @param   ipaddr  The IP address to create node structure for
- * @return  Pointer to node structure (node *) with the connection information for the IP
+ * @return  Pointer to node structure (node *) with the connection information for the IP;
+ *          NULL if the address is not numeric, and sets ChordError number
  */
-node *Chord::createNode(char *ipaddr) {
+node *Chord::createNode(const char *ipaddr) {
     if (ipaddr == NULL) {
         ipaddr = this->ipaddr;
     }
     
     // Creates a new node object
-    node *n = new node();
-    char *hostname = getHostname(ipaddr);
+    node *n = this->nodePool.acquire();
     n->hashedId = this->getConsistentHash(ipaddr, strlen(ipaddr) + 1);
-    n->ipaddr = new char[strlen(ipaddr) + 1];
-    n->hostname = new char[strlen(hostname) + 1];
-    strcpy(n->ipaddr, ipaddr);
-    strcpy(n->hostname, hostname);
+    n->ipaddr = n->ipbuf;
+    strncpy(n->ipbuf, ipaddr, sizeof(n->ipbuf) - 1);
+    n->ipbuf[sizeof(n->ipbuf) - 1] = '\0';
     
     if (strcmp(ipaddr, this->ipaddr) == 0) {
         // This node is myself
         n->isSelf = true;
         n->appPort = this->appPort;
-        n->sfd = 0;
+        n->srtt = 0;
+        n->rttvar = 0;
+        n->rttMin = 0;
+        n->rttSeen = 0;
+        n->failed = false;
+        n->paceFull = 0;
+        n->deferred = 0;
         n->addr = NULL;
         n->len = 0;
     } else {
         // Not myself
         n->isSelf = false;
         n->appPort = 0;
+        n->srtt = 0;
+        n->rttvar = 0;
+        n->rttMin = 0;
+        n->rttSeen = 0;
+        n->failed = false;
+        n->paceFull = 0;
+        n->deferred = 0;
         
-        // Set up connection information
-        struct addrinfo hints, *res;
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_family = AF_INET;
-        hints.ai_socktype = SOCK_DGRAM;
-        
-        stringstream ss;
-        ss << this->chordPort;
-        
-        int ret = getaddrinfo(hostname, ss.str().c_str(), &hints, &res);
+        // Set up connection information; everything is sent through chord_sfd
+        struct sockaddr_in *sa = (struct sockaddr_in *) &(n->addrbuf);
+        memset(sa, 0, sizeof(*sa));
+        sa->sin_family = AF_INET;
+        sa->sin_port = htons(this->chordPort);
         
-        if (ret != 0) {
-            cerr << "[ERROR] Cannot lookup " << hostname << ": " << gai_strerror(ret) << endl;
-            this->setErrorno(ERR_CANNOT_CONNECT);
-            return NULL;
-        }
-
-        int socket_fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-        if (socket_fd == -1) {
-            cerr << "[ERROR] Cannot setup socket to " << hostname << ": " << strerror(errno) << endl;
+        if (inet_pton(AF_INET, ipaddr, &(sa->sin_addr)) != 1) {
+            cerr << "[ERROR] Not an IP address: " << ipaddr << endl;
             this->setErrorno(ERR_CANNOT_CONNECT);
+            this->nodePool.release(n);
             return NULL;
         }
         
-        n->sfd = socket_fd;
-        n->addr = res->ai_addr;
-        n->len = res->ai_addrlen;
+        n->addr = (struct sockaddr *) sa;
+        n->len = sizeof(*sa);
     }
     
     return n;
@@ -824,20 +2553,35 @@ node *Chord::createNode(char *ipaddr) {
  */
 char *Chord::getFingerTable() {
     stringstream ss;
-    pthread_mutex_lock(&(this->fingerMutex));
-    for (map<uint32_t, node *>::iterator it = this->fingers.begin(); it != this->fingers.end(); ++it) {
-        if (it->second == NULL) {
-            ss << setw(10) << setfill(' ') << it->first << ": NULL\n";
+    for (unsigned int i = 0; i < CHORD_LENGTH_BIT; ++i) {
+        node *finger = this->getFinger(i);
+        if (finger == NULL) {
+            ss << setw(10) << setfill(' ') << this->fingerStart[i] << ": NULL\n";
         } else {
-            ss << setw(10) << setfill(' ') << it->first << ": " << getComputerName(it->second->hostname)
-               << " # " << it->second->hashedId << "\n";
+            ss << setw(10) << setfill(' ') << this->fingerStart[i] << ": " << this->getDisplayName(finger->ipaddr)
+               << " # " << finger->hashedId << "\n";
         }
     }
-    pthread_mutex_unlock(&(this->fingerMutex));
     
     return cstr(ss.str());
 }
 
+/**
+ * Returns the short host name of a node for display, as far as the name resolver
+ * knows it yet; otherwise its IP address
+ * 
+ * @param   ipaddr  The IP address of the node
+ * @return  The name to display
+ */
+string Chord::getDisplayName(const char *ipaddr) {
+    string name;
+    if (!this->names.getName(ipaddr, name)) {
+        return string(ipaddr);
+    }
+    
+    return name.substr(0, name.find_first_of("."));
+}
+
 /**
  * Get the ring map of the chord in texual format
  * e.g. [server1]=>[server2]=>[server5]=>[server4]=>[server1] (end)
@@ -849,23 +2593,26 @@ char *Chord::getChordMap() {
         // If the service is not working, then there is no map
         this->setErrorno(ERR_NOT_IN_SERVICE);
         return NULL;
-    } else if (this->successor == NULL || this->successor->isSelf) {
+    }
+    
+    node *succ = this->getSuccessor();
+    if (succ == NULL || succ->isSelf) {
         this->setErrorno(ERR_NO_SUCCESSOR);
         return NULL;
     }
     
     this->state = ChordStatus::MAPPING_CHORD;
     // Query sequence starts with 1, 0 means deadend
-    ChordMapQuery *cmq = MessageHandler::createChordMapQuery(1, this->ipaddr);
+    ChordMapQuery cmq = MessageHandler::makeChordMapQuery(1, this->ipaddr);
     
     // A sequence number to host IP mapping
-    map<uint32_t, char *> chordMap;
+    map<uint32_t, string> chordMap;
     // First one is of course current node
     chordMap[1] = this->ipaddr;
     
     // Sends the query request to successor
-    unsigned char *serialized = MessageHandler::serialize(cmq);
-    this->send(this->successor, serialized, cmq->size);
+    unsigned char serialized[MAX_DATAGRAM];
+    this->send(succ, serialized, MessageHandler::encode(&cmq, serialized, sizeof(serialized)));
     
     // Wait until the mapping has been completed
     while (this->state != ChordStatus::MAPPING_COMPLETED) {
@@ -878,6 +2625,9 @@ char *Chord::getChordMap() {
     while (cmr != NULL) {
         // If so, sort them into the map for printout
         chordMap[cmr->seq] = cmr->responder;
+        
+        delete[] cmr->responder;
+        delete cmr;
         cmr = this->popChordMapResponse();
     }
     
@@ -885,16 +2635,18 @@ char *Chord::getChordMap() {
     // seq of dead ended nodes are set to 0
     bool deadend = false;
     stringstream mapstr;
-    for (map<uint32_t, char *>::iterator it = chordMap.begin(); it != chordMap.end(); ++it) {
+    for (map<uint32_t, string>::iterator it = chordMap.begin(); it != chordMap.end(); ++it) {
         if (it->first == 0) {
             deadend = true;
             continue;
         }
         
-        mapstr << "[" << getComputerName(getHostname(it->second)) << "]-->";
+        mapstr << "[" << this->getDisplayName(it->second.c_str()) << "]-->";
     }
     
-    mapstr << "[" << getComputerName(this->hostname) << "]";
+    char *selfName = getComputerName(this->hostname);
+    mapstr << "[" << selfName << "]";
+    delete[] selfName;
     if (deadend) {
         mapstr << "-->[" << chordMap[0] << "] (Deadend)";
     } else {
@@ -915,11 +2667,25 @@ char *Chord::getChordMap() {
  * @return  Size sent; -1 if error
  */
 size_t Chord::send(node *n, unsigned char *data, size_t len, int flag) {
+    if (n == NULL || n->addr == NULL) {
+        dprt << "Not sending message without a recipient address";
+        return -1;
+    }
+    
+    if (!this->admitSend(n, data, len)) {
+        // Goes out once the window opens, or never
+        return len;
+    }
+    
     size_t sent = 0;
     while (sent < len) {
-        ssize_t size = sendto(n->sfd, data + sent, len - sent, flag, n->addr, n->len);
+        ssize_t size = sendto(this->chord_sfd, data + sent, len - sent, flag, n->addr, n->len);
         
-        if (size == -1) {
+        if (size == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // Goes out once the send buffer drains, or never
+            this->blockSend(n->addr, n->len, data + sent, len - sent);
+            return len;
+        } else if (size == -1) {
             cerr << "[ERROR] Problem sending data: " << strerror(errno) << endl;
             return size;
         }
@@ -931,64 +2697,322 @@ size_t Chord::send(node *n, unsigned char *data, size_t len, int flag) {
 }
 
 /**
- * Calculates the consistent hashing of the specified parametre.
+ * Queues a message for the next flushSends(). Only used from the receiver thread
  * 
- * @param   tohash  The item to calculate hash for
- * @param   len     The length of tohash
- * @return  The calculated hash
+ * @param   n       The node to send to
+ * @param   data    The data to send (must be serialized with MessageHandler);
+ *                  must stay valid until flushSends() returns
+ * @param   len     The length of data
  */
-unsigned int Chord::getConsistentHash(char *tohash, size_t len) {
-    unsigned char *hash = new unsigned char[160];
-    SHA1((unsigned char *) tohash, len, hash);
+void Chord::queueSend(node *n, unsigned char *data, size_t len) {
+    if (n == NULL || n->addr == NULL) {
+        dprt << "Not queueing message without a recipient address";
+        return;
+    }
     
-    stringstream ss;
-    for(int i = 0; i < 20; ++i) {
-        ss << hex << setw(2) << setfill('0') << (int)hash[i];
+    if (!this->admitSend(n, data, len)) {
+        return;
     }
     
-    // Uses large number library (GMP) because SHA1 hash is longer than C++ unsigned long long bit length
-    mpz_t chash, largenum;
-    mpz_inits(chash, largenum, NULL);
-    mpz_set_str(largenum, cstr(ss.str()), 16);
-    // Calculates modulo
-    mpz_mod_ui(chash, largenum, pow((long double) 2, (long double) CHORD_LENGTH_BIT));
+    if (this->outbox.full()) {
+        this->flushSends();
+    }
+    
+    this->outbox.add(n->addr, n->len, data, len);
+}
+
+/**
+ * Sends all messages queued by queueSend() through the chord socket
+ * 
+ * @return  Number of messages sent; -1 if error
+ */
+int Chord::flushSends() {
+    return this->flushBatch(this->outbox);
+}
+
+/**
+ * Sends all datagrams of a batch through the chord socket. Those the send buffer
+ * has no room for are kept to be sent once it drains, see drainBlockedSends()
+ * 
+ * @param   batch   The queued datagrams
+ * @return  Number of datagrams sent now; -1 if error
+ */
+int Chord::flushBatch(SendBatch &batch) {
+    unsigned int queued = batch.size();
+    if (queued == 0) {
+        return 0;
+    }
     
-    unsigned int pos = (unsigned int) mpz_get_ui(chash);
-    dprt << "Key/Node " << tohash << " maps to " << pos;
+    int sent = batch.flush(this->chord_sfd);
+    if (sent < (int) queued && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        for (unsigned int i = max(sent, 0); i < queued; ++i) {
+            this->blockSend(batch.address(i), batch.addressLength(i), batch.data(i), batch.length(i));
+        }
+    } else if (sent == -1) {
+        cerr << "[ERROR] Problem sending data: " << strerror(errno) << endl;
+    }
     
-    return pos;
+    return sent;
+}
+
+/**
+ * Keeps a copy of a datagram the socket had no room for and has the reactor
+ * report when it is writable again. Beyond BLOCKED_SEND_LIMIT waiting, the
+ * datagram is dropped and left to the retransmit timers
+ * 
+ * @param   addr    The recipient's address; a node's, so it outlives the copy
+ * @param   addrlen Length of addr
+ * @param   data    The datagram
+ * @param   len     The length of data
+ */
+void Chord::blockSend(struct sockaddr *addr, socklen_t addrlen, unsigned char *data, size_t len) {
+    pthread_mutex_lock(&(this->blockedSendMutex));
+    if (this->blockedSends.size() >= BLOCKED_SEND_LIMIT || len > MAX_DATAGRAM) {
+        pthread_mutex_unlock(&(this->blockedSendMutex));
+        __atomic_fetch_add(&(this->counters.sendsDropped), 1, __ATOMIC_RELAXED);
+        return;
+    }
+    
+    blockedSend b;
+    b.addr = addr;
+    b.len = addrlen;
+    b.dg = this->datagramPool.acquire();
+    b.dg->len = len;
+    memcpy(b.dg->data, data, len);
+    this->blockedSends.push_back(b);
+    
+    if (!this->writeWatched) {
+        this->writeWatched = this->reactor.watchWritable(this->chord_sfd, true);
+    }
+    pthread_mutex_unlock(&(this->blockedSendMutex));
+    
+    __atomic_fetch_add(&(this->counters.sendsBlocked), 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Sends the datagrams blocked by a full send buffer, oldest first, until it is
+ * full again or they are all out. Only called from the receiver thread, when
+ * the reactor reports the socket writable
+ */
+void Chord::drainBlockedSends() {
+    SendBatch batch(IO_BATCH);
+    vector<datagram *> sent;
+    
+    pthread_mutex_lock(&(this->blockedSendMutex));
+    while (!this->blockedSends.empty()) {
+        for (unsigned int i = 0; i < this->blockedSends.size() && !batch.full(); ++i) {
+            blockedSend &b = this->blockedSends[i];
+            batch.add(b.addr, b.len, b.dg->data, b.dg->len);
+        }
+        
+        int count = batch.flush(this->chord_sfd);
+        if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (count == -1) {
+            // Does not hold up the others
+            cerr << "[ERROR] Problem sending data: " << strerror(errno) << endl;
+            __atomic_fetch_add(&(this->counters.sendsDropped), 1, __ATOMIC_RELAXED);
+            count = 1;
+        }
+        
+        for (int i = 0; i < count; ++i) {
+            sent.push_back(this->blockedSends.front().dg);
+            this->blockedSends.pop_front();
+        }
+    }
+    
+    if (this->blockedSends.empty() && this->writeWatched) {
+        this->reactor.watchWritable(this->chord_sfd, false);
+        this->writeWatched = false;
+    }
+    pthread_mutex_unlock(&(this->blockedSendMutex));
+    
+    for (unsigned int i = 0; i < sent.size(); ++i) {
+        this->datagramPool.release(sent[i]);
+    }
 }
 
 /**
- * Pushes received successor response to queue
+ * Paces the datagrams to a peer: each takes a token from the peer's bucket, and
+ * those finding it empty are held back in order, to be sent by the receiver
+ * thread as tokens come back. Beyond PEER_QUEUE_LIMIT held back, they are dropped
+ * and left to the retransmit timers
  * 
- * @param   sr  The message to push
+ * @param   n       The recipient
+ * @param   data    The datagram; copied if held back
+ * @param   len     The length of data
+ * @return  True if it may be sent now, false if it was held back or dropped
  */
-void Chord::pushSuccessorResponse(SuccessorResponse *sr) {
-    pthread_mutex_lock(&(this->successorResponseQueueMutex));
-    this->successorResponseQueue.push_back(sr);
-    pthread_mutex_unlock(&(this->successorResponseQueueMutex));
+bool Chord::admitSend(node *n, unsigned char *data, size_t len) {
+    if (n == NULL || n->isSelf) {
+        return true;
+    }
+    
+    // Nothing overtakes what is already held back
+    if (__atomic_load_n(&(n->deferred), __ATOMIC_ACQUIRE) == 0 && this->takeToken(n)) {
+        return true;
+    }
+    
+    if (len > MAX_DATAGRAM) {
+        return true;
+    }
+    
+    bool arm = false;
+    pthread_mutex_lock(&(this->paceMutex));
+    deque<datagram *> &queue = this->deferredSends[n];
+    if (queue.size() >= PEER_QUEUE_LIMIT) {
+        pthread_mutex_unlock(&(this->paceMutex));
+        __atomic_fetch_add(&(this->counters.sendsDropped), 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    
+    datagram *dg = this->datagramPool.acquire();
+    dg->len = len;
+    memcpy(dg->data, data, len);
+    queue.push_back(dg);
+    __atomic_fetch_add(&(n->deferred), 1, __ATOMIC_RELEASE);
+    
+    arm = !this->paceArmed;
+    this->paceArmed = true;
+    pthread_mutex_unlock(&(this->paceMutex));
+    
+    __atomic_fetch_add(&(this->counters.sendsDeferred), 1, __ATOMIC_RELAXED);
+    if (arm) {
+        this->armTimer(&(this->paceTimer), WHEEL_TICK);
+    }
+    
+    return false;
 }
 
 /**
- * Returns and removes the first item in successor response queue, effectively
- * reduces the queue's size by 1
+ * Takes a token from the bucket of a peer, if there is one
+ * 
+ * The bucket holds PEER_WINDOW tokens and gets one back every interval, the
+ * longer of 1 / PEER_RATE and rttMin / PEER_WINDOW, so no more than a window is
+ * in flight per round trip. The lowest round trip time is used since the others
+ * include time spent waiting here, which would slow pacing down further and
+ * further. The bucket is kept as the time it is full again (GCRA)
  * 
- * @return  The first item in the successor response queue. NULL if queue is emtpy
+ * @param   n   The recipient
+ * @return  True if a token was taken
  */
-SuccessorResponse *Chord::popSuccessorResponse() {
-    SuccessorResponse *ret = NULL;
+bool Chord::takeToken(node *n) {
+    uint64_t interval = max((uint64_t) 1000000 / PEER_RATE,
+            (uint64_t) __atomic_load_n(&(n->rttMin), __ATOMIC_RELAXED) / PEER_WINDOW);
+    uint64_t now = TimingWheel::now();
     
-    pthread_mutex_lock(&(this->successorResponseQueueMutex));
-    vector<SuccessorResponse *>::iterator it = this->successorResponseQueue.begin();
-    if (it != this->successorResponseQueue.end()) {
-        // Has item
-        ret = (*it);
-        this->successorResponseQueue.erase(it);
+    uint64_t full = __atomic_load_n(&(n->paceFull), __ATOMIC_RELAXED);
+    uint64_t next;
+    do {
+        next = max(full, now) + interval;
+        if (next - now > interval * PEER_WINDOW) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&(n->paceFull), &full, next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    
+    return true;
+}
+
+/**
+ * Sends the held back datagrams whose recipients have tokens again, oldest
+ * first. Only called from the receiver thread
+ */
+void Chord::drainDeferredSends() {
+    vector<datagram *> sent;
+    
+    pthread_mutex_lock(&(this->paceMutex));
+    map<node *, deque<datagram *> >::iterator it = this->deferredSends.begin();
+    while (it != this->deferredSends.end()) {
+        node *n = it->first;
+        deque<datagram *> &queue = it->second;
+        
+        while (!queue.empty() && this->takeToken(n)) {
+            if (this->outbox.full()) {
+                this->flushSends();
+            }
+            
+            this->outbox.add(n->addr, n->len, queue.front()->data, queue.front()->len);
+            sent.push_back(queue.front());
+            queue.pop_front();
+            __atomic_fetch_sub(&(n->deferred), 1, __ATOMIC_RELEASE);
+        }
+        
+        if (queue.empty()) {
+            this->deferredSends.erase(it++);
+        } else {
+            ++it;
+        }
     }
-    pthread_mutex_unlock(&(this->successorResponseQueueMutex));
     
-    return ret;
+    this->flushSends();
+    this->paceArmed = !this->deferredSends.empty();
+    if (this->paceArmed) {
+        this->armTimer(&(this->paceTimer), WHEEL_TICK);
+    }
+    pthread_mutex_unlock(&(this->paceMutex));
+    
+    for (unsigned int i = 0; i < sent.size(); ++i) {
+        this->datagramPool.release(sent[i]);
+    }
+}
+
+/**
+ * Maps a SHA-1 digest to its position on the ring
+ * 
+ * The ID is the digest, read as a big-endian number, modulo 2^CHORD_LENGTH_BIT,
+ * which is just its last CHORD_LENGTH_BIT bits. Reading the last four bytes
+ * gives the same IDs the GMP based reduction did, without any allocation
+ * 
+ * @param   hash    The digest
+ * @return  The ID
+ */
+static inline uint32_t digestToId(const unsigned char *hash) {
+    uint32_t pos = ((uint32_t) hash[SHA_DIGEST_LENGTH - 4] << 24)
+            | ((uint32_t) hash[SHA_DIGEST_LENGTH - 3] << 16)
+            | ((uint32_t) hash[SHA_DIGEST_LENGTH - 2] << 8)
+            | (uint32_t) hash[SHA_DIGEST_LENGTH - 1];
+    
+    if (CHORD_LENGTH_BIT < 32) {
+        pos &= (1U << (CHORD_LENGTH_BIT % 32)) - 1;
+    }
+    
+    return pos;
+}
+
+/**
+ * Calculates the consistent hashing of the specified parametre.
+ * 
+ * @param   tohash  The item to calculate hash for
+ * @param   len     The length of tohash
+ * @return  The calculated hash
+ */
+unsigned int Chord::getConsistentHash(const char *tohash, size_t len) {
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    SHA1((const unsigned char *) tohash, len, hash);
+    
+    return digestToId(hash);
+}
+
+/**
+ * Calculates the consistent hashing of many items at once, see KeyHasher
+ * 
+ * @param   tohash  The items to calculate hash for
+ * @param   lens    The length of each item
+ * @param   count   Number of items
+ * @param   ids     Receives the calculated hash of each item
+ */
+void Chord::getConsistentHashes(const char **tohash, const size_t *lens, unsigned int count, uint32_t *ids) {
+    // Hashed in chunks, so the digests stay on the stack
+    unsigned char digests[HASH_BATCH][SHA_DIGEST_LENGTH];
+    
+    for (unsigned int i = 0; i < count; i += HASH_BATCH) {
+        unsigned int n = (count - i < HASH_BATCH) ? count - i : HASH_BATCH;
+        KeyHasher::sha1((const unsigned char **) tohash + i, lens + i, n, digests);
+        
+        for (unsigned int j = 0; j < n; ++j) {
+            ids[i + j] = digestToId(digests[j]);
+        }
+    }
 }
 
 /**
@@ -1032,14 +3056,27 @@ ChordMapResponse *Chord::popChordMapResponse() {
  * @param   len         The length of data
  */
 void Chord::pushSendTimer(node *sendTo, uint32_t searchTerm, unsigned char *data, size_t len) {
-    msgTimer *mtimer = new msgTimer();
+    if (len > MAX_DATAGRAM) {
+        dprt << "Message too large to retransmit: " << len;
+        return;
+    }
+    
+    msgTimer *mtimer = this->timerPool.acquire();
     mtimer->recipient = sendTo;
-    mtimer->context = new unsigned char[len];
+    mtimer->retries = 0;
+    mtimer->sentAt = TimingWheel::now();
     memcpy(mtimer->context, data, len);
+    TimingWheel::initTimer(&(mtimer->timer), ChordTimer::RESEND, searchTerm);
     
     pthread_mutex_lock(&(this->sendTimerMutex));
+    map<uint32_t, msgTimer *>::iterator it = this->sendTimers.find(searchTerm);
+    if (it != this->sendTimers.end()) {
+        // Replaces the previous message with the same ID
+        this->timers.cancel(&(it->second->timer));
+        this->timerPool.release(it->second);
+    }
     this->sendTimers[searchTerm] = mtimer;
-    (this->sendTimers[searchTerm])->timestamp = getTimeInUSeconds();
+    this->armTimer(&(mtimer->timer), this->getRto(sendTo, SEND_TIMEOUT, 0));
     pthread_mutex_unlock(&(this->sendTimerMutex));
 }
 
@@ -1049,14 +3086,24 @@ void Chord::pushSendTimer(node *sendTo, uint32_t searchTerm, unsigned char *data
  * @param   searchTerm  The item to remove
  */
 void Chord::unsetSendTimer(uint32_t searchTerm) {
+    node *acked = NULL;
+    uint32_t elapsed = 0;
+    
     pthread_mutex_lock(&(this->sendTimerMutex));
     map<uint32_t, msgTimer *>::iterator it = this->sendTimers.find(searchTerm);
     if (it != this->sendTimers.end()) {
-        delete[] it->second->context;
-        delete it->second;
+        if (it->second->retries == 0) {
+            acked = it->second->recipient;
+            elapsed = TimingWheel::now() - it->second->sentAt;
+        }
+        
+        this->timers.cancel(&(it->second->timer));
+        this->timerPool.release(it->second);
         this->sendTimers.erase(it);
     }
     pthread_mutex_unlock(&(this->sendTimerMutex));
+    
+    this->sampleRtt(acked, elapsed);
 }
 
 /**
@@ -1073,7 +3120,7 @@ bool Chord::isInSuccessor(uint32_t key, uint32_t start, uint32_t end) {
     }
     
     if (end == 0) {
-        end = this->successor->hashedId;
+        end = this->getSuccessor()->hashedId;
     }
     
     if ((key > start && key <= end)
@@ -1088,41 +3135,63 @@ bool Chord::isInSuccessor(uint32_t key, uint32_t start, uint32_t end) {
 /**
  * Get the successor of key
  * 
+ * With the finger table, this is the closest finger preceding key, the node to
+ * forward a lookup to. Finger i starts 2^i past this node, so only the fingers
+ * starting before key can precede it; the search starts at the highest of them,
+ * found from the bit length of the distance to key, and nearly always stops there
+ * 
  * @param   key         The key to get successor of
  * @param   useFinger   Whether to use finger table or not. Default is true
  * @return  The node pointer pointing to the successor node structure
  */
 node *Chord::getSuccessorOf(uint32_t key, bool useFinger) {
     if (!useFinger) {
-        return this->successor;
+        return this->getSuccessor();
     }
     
     node *ret = NULL;
-    map<uint32_t, node *>::reverse_iterator it;
+    uint32_t toKey = ringDistance(this->hashedId, key);
     
-    pthread_mutex_lock(&(this->fingerMutex));
-    for (it = this->fingers.rbegin(); it != this->fingers.rend(); ++it) {
-        if (it->second == NULL) {
-            continue;
-        }
-        
-        if (it->first < key) {
-            if ((--it) != this->fingers.rbegin()) {
-                ret = it->second;
+    SnapshotCell<routingTable>::Reader table(this->routing);
+    if (toKey > 1) {
+        // Highest i with 2^i < toKey
+        for (int i = 31 - __builtin_clz(toKey - 1); i >= 0; --i) {
+            node *f = table->fingers[i];
+            if (f == NULL) {
+                continue;
             }
             
-            break;
+            // Strictly between this node and key, however the interval wraps
+            uint32_t toFinger = ringDistance(this->hashedId, f->hashedId);
+            if (toFinger - 1 < toKey - 1) {
+                ret = f;
+                break;
+            }
         }
     }
-    pthread_mutex_unlock(&(this->fingerMutex));
     
-    if (ret == NULL) {
-        ret = this->successor;
+    if (ret == NULL && table->successorCount > 0) {
+        ret = table->successors[0];
     }
 
     return ret;
 }
 
+/**
+ * Finds which finger a finger query was for
+ * 
+ * @param   searchTerm  The ID the finger query looked up
+ * @return  The finger number; -1 if searchTerm is no finger start of this node
+ */
+int Chord::getFingerIndex(uint32_t searchTerm) {
+    uint32_t delta = ringDistance(this->hashedId, searchTerm);
+    if (delta == 0 || (delta & (delta - 1)) != 0) {
+        return -1;
+    }
+    
+    return __builtin_ctz(delta);
+}
+
 /**
  * Returns the current state of the service
  * 
@@ -1131,3 +3200,19 @@ node *Chord::getSuccessorOf(uint32_t key, bool useFinger) {
 ChordStatus::status Chord::getState() {
     return this->state;
 }
+
+/**
+ * Returns the running totals of the service
+ * 
+ * @return  A copy of the counters
+ */
+ChordCounters Chord::getCounters() {
+    ChordCounters ret;
+    ret.retransmits = __atomic_load_n(&(this->counters.retransmits), __ATOMIC_RELAXED);
+    ret.retransmitFailures = __atomic_load_n(&(this->counters.retransmitFailures), __ATOMIC_RELAXED);
+    ret.sendsDeferred = __atomic_load_n(&(this->counters.sendsDeferred), __ATOMIC_RELAXED);
+    ret.sendsDropped = __atomic_load_n(&(this->counters.sendsDropped), __ATOMIC_RELAXED);
+    ret.sendsBlocked = __atomic_load_n(&(this->counters.sendsBlocked), __ATOMIC_RELAXED);
+    
+    return ret;
+}
@@ -0,0 +1,316 @@
+#include <cstring>
+#include <vector>
+
+#include <stdint.h>
+
+#include "../include/KeyHasher.hpp"
+
+using namespace std;
+
+/*
+ * The lanes use GCC vector extensions, so the same code compiles to SSE2, AVX2
+ * or whatever vector unit the target has; only the AVX2 entry point needs its
+ * own target attribute, with runtime dispatch on the CPU
+ */
+typedef uint32_t lanes4 __attribute__((vector_size(16)));
+typedef uint32_t lanes8 __attribute__((vector_size(32)));
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KEY_HASHER_X86
+#endif
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static const uint32_t SHA1_IV[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+/*
+ * Longest key the lanes hash faster than OpenSSL: one that pads to two blocks.
+ * Past that the per-block transposition costs more than the lanes save
+ * (see test/keyhasher_bench), so longer keys are hashed one at a time
+ */
+static const size_t MULTI_BUFFER_MAX_LEN = 119;
+
+/**
+ * Progress of one lane through its current key
+ */
+typedef struct {
+    int key;                // -1 if the lane is idle
+    uint64_t block;         // Next block of the padded key
+    uint64_t blocks;        // Number of blocks of the padded key
+} laneJob;
+
+/**
+ * Writes block number n of the padded key, as 16 host order words
+ */
+static inline void padBlock(const unsigned char *key, size_t len, uint64_t n, uint64_t blocks, uint32_t *words) {
+    unsigned char block[64];
+    size_t offset = n * 64;
+
+    size_t take = (offset < len) ? len - offset : 0;
+    if (take > 64) {
+        take = 64;
+    }
+    memcpy(block, key + offset, take);
+    memset(block + take, 0, 64 - take);
+
+    if (offset + take == len && take < 64) {
+        // The key ends in this block, or ended exactly at the previous one
+        block[take] = 0x80;
+    }
+
+    if (n == blocks - 1) {
+        uint64_t bits = (uint64_t) len * 8;
+        for (int i = 0; i < 8; ++i) {
+            block[63 - i] = (unsigned char) (bits >> (8 * i));
+        }
+    }
+
+    for (int i = 0; i < 16; ++i) {
+        words[i] = ((uint32_t) block[4 * i] << 24) | ((uint32_t) block[4 * i + 1] << 16)
+                | ((uint32_t) block[4 * i + 2] << 8) | (uint32_t) block[4 * i + 3];
+    }
+}
+
+/**
+ * Runs the SHA-1 compression function on one block per lane
+ *
+ * @param   state   The five state words of every lane
+ * @param   w       The 16 block words of every lane
+ */
+template <class V>
+static inline __attribute__((always_inline)) void compressLanes(V *state, V *w) {
+    V a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+    for (int t = 0; t < 80; ++t) {
+        if (t >= 16) {
+            V x = w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15];
+            w[t & 15] = ROTL(x, 1);
+        }
+
+        V f;
+        uint32_t k;
+        if (t < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (t < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (t < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+
+        V tmp = ROTL(a, 5) + f + e + k + w[t & 15];
+        e = d;
+        d = c;
+        c = ROTL(b, 30);
+        b = a;
+        a = tmp;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+/**
+ * Hashes all keys, LANES at a time
+ */
+template <class V, unsigned int LANES>
+static inline __attribute__((always_inline)) void hashLanes(const unsigned char **keys, const size_t *lens,
+        unsigned int count, unsigned char (*digests)[SHA_DIGEST_LENGTH]) {
+    laneJob jobs[LANES];
+    uint32_t state[5][LANES] __attribute__((aligned(32)));
+    uint32_t words[16][LANES] __attribute__((aligned(32)));
+    uint32_t block[16];
+
+    unsigned int next = 0, active = 0;
+    for (unsigned int l = 0; l < LANES; ++l) {
+        jobs[l].key = -1;
+    }
+
+    do {
+        // Give idle lanes the next key
+        for (unsigned int l = 0; l < LANES; ++l) {
+            if (jobs[l].key == -1 && next < count) {
+                jobs[l].key = next;
+                jobs[l].block = 0;
+                jobs[l].blocks = (lens[next] + 8) / 64 + 1;
+                for (int i = 0; i < 5; ++i) {
+                    state[i][l] = SHA1_IV[i];
+                }
+
+                next++;
+                active++;
+            }
+        }
+
+        if (active == 0) {
+            break;
+        }
+
+        // Transpose the blocks into lanes; idle lanes hash whatever is left over
+        for (unsigned int l = 0; l < LANES; ++l) {
+            if (jobs[l].key == -1) {
+                continue;
+            }
+
+            padBlock(keys[jobs[l].key], lens[jobs[l].key], jobs[l].block, jobs[l].blocks, block);
+            for (int i = 0; i < 16; ++i) {
+                words[i][l] = block[i];
+            }
+        }
+
+        V vstate[5], vw[16];
+        memcpy(vstate, state, sizeof(vstate));
+        memcpy(vw, words, sizeof(vw));
+        compressLanes<V>(vstate, vw);
+        memcpy(state, vstate, sizeof(vstate));
+
+        // Lanes done with their key write out the digest and become idle
+        for (unsigned int l = 0; l < LANES; ++l) {
+            if (jobs[l].key == -1 || ++(jobs[l].block) < jobs[l].blocks) {
+                continue;
+            }
+
+            unsigned char *digest = digests[jobs[l].key];
+            for (int i = 0; i < 5; ++i) {
+                digest[4 * i] = (unsigned char) (state[i][l] >> 24);
+                digest[4 * i + 1] = (unsigned char) (state[i][l] >> 16);
+                digest[4 * i + 2] = (unsigned char) (state[i][l] >> 8);
+                digest[4 * i + 3] = (unsigned char) state[i][l];
+            }
+
+            jobs[l].key = -1;
+            active--;
+        }
+    } while (active > 0 || next < count);
+}
+
+static void sha1x4(const unsigned char **keys, const size_t *lens, unsigned int count,
+        unsigned char (*digests)[SHA_DIGEST_LENGTH]) {
+    hashLanes<lanes4, 4>(keys, lens, count, digests);
+}
+
+#ifdef KEY_HASHER_X86
+__attribute__((target("avx2")))
+static void sha1x8(const unsigned char **keys, const size_t *lens, unsigned int count,
+        unsigned char (*digests)[SHA_DIGEST_LENGTH]) {
+    hashLanes<lanes8, 8>(keys, lens, count, digests);
+}
+#endif
+
+/**
+ * Whether the 8 lane AVX2 implementation can be used on this CPU
+ */
+static bool hasAvx2() {
+#ifdef KEY_HASHER_X86
+    static int avx2 = -1;
+    if (avx2 == -1) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+
+    return avx2 == 1;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Computes the SHA-1 digest of every key, as many at a time as the CPU allows
+ *
+ * @param   keys        The keys to hash
+ * @param   lens        The length of each key, in bytes
+ * @param   count       Number of keys
+ * @param   digests     Receives the digest of each key, in the same order
+ */
+void KeyHasher::sha1(const unsigned char **keys, const size_t *lens, unsigned int count,
+        unsigned char (*digests)[SHA_DIGEST_LENGTH]) {
+    unsigned int longKeys = 0;
+    for (unsigned int i = 0; i < count; ++i) {
+        if (lens[i] > MULTI_BUFFER_MAX_LEN) {
+            longKeys++;
+        }
+    }
+
+    if (longKeys > 0) {
+        // Hash the long keys here and the short ones through the lanes, gathered
+        vector<const unsigned char *> shortKeys;
+        vector<size_t> shortLens;
+        vector<unsigned int> shortIndex;
+        shortKeys.reserve(count - longKeys);
+        shortLens.reserve(count - longKeys);
+        shortIndex.reserve(count - longKeys);
+
+        for (unsigned int i = 0; i < count; ++i) {
+            if (lens[i] > MULTI_BUFFER_MAX_LEN) {
+                SHA1(keys[i], lens[i], digests[i]);
+            } else {
+                shortKeys.push_back(keys[i]);
+                shortLens.push_back(lens[i]);
+                shortIndex.push_back(i);
+            }
+        }
+
+        if (shortKeys.empty()) {
+            return;
+        }
+
+        vector<unsigned char> shortDigests(shortKeys.size() * SHA_DIGEST_LENGTH);
+        unsigned char (*gathered)[SHA_DIGEST_LENGTH] = (unsigned char (*)[SHA_DIGEST_LENGTH]) &shortDigests[0];
+        KeyHasher::sha1(&shortKeys[0], &shortLens[0], shortKeys.size(), gathered);
+        for (unsigned int i = 0; i < shortIndex.size(); ++i) {
+            memcpy(digests[shortIndex[i]], gathered[i], SHA_DIGEST_LENGTH);
+        }
+        return;
+    }
+
+    if (count < 2) {
+        // Nothing to interleave
+        KeyHasher::sha1Scalar(keys, lens, count, digests);
+        return;
+    }
+
+#ifdef KEY_HASHER_X86
+    if (hasAvx2() && count >= 4) {
+        sha1x8(keys, lens, count, digests);
+        return;
+    }
+#endif
+
+    sha1x4(keys, lens, count, digests);
+}
+
+/**
+ * Same as sha1(), one key at a time through OpenSSL
+ */
+void KeyHasher::sha1Scalar(const unsigned char **keys, const size_t *lens, unsigned int count,
+        unsigned char (*digests)[SHA_DIGEST_LENGTH]) {
+    for (unsigned int i = 0; i < count; ++i) {
+        SHA1(keys[i], lens[i], digests[i]);
+    }
+}
+
+/**
+ * Number of keys sha1() hashes at once on this CPU
+ */
+unsigned int KeyHasher::getLanes() {
+    return hasAvx2() ? 8 : 4;
+}
+
+/**
+ * Name of the implementation sha1() uses for full batches on this CPU
+ */
+const char *KeyHasher::getImplementation() {
+#ifdef KEY_HASHER_X86
+    return hasAvx2() ? "avx2" : "sse2";
+#else
+    return "simd128";
+#endif
+}
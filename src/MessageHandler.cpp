@@ -3,10 +3,52 @@
 
 #include "../include/MessageHandler.hpp"
 #include "../include/MessageTypes.hpp"
+#include "../include/MessageViews.hpp"
 #include "../include/Utils.hpp"
 
 using namespace std;
 
+/**
+ * Writes a 4-byte integer in network byte order
+ */
+static inline void putField(unsigned char *buffer, size_t offset, uint32_t val) {
+    val = htonl(val);
+    memcpy(buffer + offset, &val, 4);
+}
+
+/**
+ * Writes the trailing string field of a message, if there is one
+ */
+static inline void putString(unsigned char *buffer, size_t offset, uint32_t size, const char *str) {
+    if (size > offset && str != NULL) {
+        memcpy(buffer + offset, str, size - offset);
+    }
+}
+
+/**
+ * Returns how many bytes the routing hints of a message take on the wire
+ */
+static inline size_t hintsLength(const RoutingHints &hints) {
+    return (hints.count > 0) ? 12 + hints.count * MessageView::HINT_ENTRY : 0;
+}
+
+/**
+ * Writes the routing hints of a message at offset, if it has any
+ */
+static inline void putHints(unsigned char *buffer, size_t offset, const RoutingHints &hints) {
+    if (hints.count == 0) {
+        return;
+    }
+    
+    putField(buffer, offset, hints.count);
+    putField(buffer, offset + 4, hints.flags);
+    putField(buffer, offset + 8, hints.senderId);
+    for (uint32_t i = 0; i < hints.count; ++i) {
+        putField(buffer, offset + 12 + i * MessageView::HINT_ENTRY, hints.entries[i].appPort);
+        memcpy(buffer + offset + 16 + i * MessageView::HINT_ENTRY, hints.entries[i].ipaddr, SUCCESSOR_IP_LEN);
+    }
+}
+
 /**
  * Serializes the parametre message based on its type
  * 
@@ -19,112 +61,237 @@ unsigned char *MessageHandler::serialize(void *msg) {
         return NULL;
     }
     
-    unsigned char *ret = NULL;
+    unsigned char *ret = new unsigned char[MessageHandler::getSize(msg)];
+    if (MessageHandler::encode(msg, ret, MessageHandler::getSize(msg)) == 0) {
+        delete[] ret;
+        return NULL;
+    }
+    
+    return ret;
+}
+
+/**
+ * Serializes the parametre message into a caller supplied buffer, without allocating
+ * 
+ * @param   msg     The item to serialize
+ * @param   buffer  Where to write the serialized data
+ * @param   len     Size of buffer
+ * @return  Number of bytes written; 0 if msg cannot be identified or does not fit
+ */
+size_t MessageHandler::encode(void *msg, unsigned char *buffer, size_t len) {
+    uint32_t size = MessageHandler::getSize(msg);
+    if (size > len) {
+        dprt << "Message of size " << size << " does not fit in " << len << " bytes";
+        return 0;
+    }
     
     switch (MessageHandler::getType(msg)) {
         case MTYPE_UPDATE_PREDECESSOR:
         {
             UpdatePredcessor *up = (UpdatePredcessor *) msg;
-            ret = new unsigned char[up->size];
-            memcpy(ret, itobc(htonl(up->type)), 4);
-            memcpy(ret + 4, itobc(htonl(up->size)), 4);
-            memcpy(ret + 8, itobc(htonl(up->appPort)), 4);
-            if (up->size - 12 > 0) {
-                memcpy(ret + 12, up->predecessor, up->size - 12);
-            }
+            putField(buffer, 0, up->type);
+            putField(buffer, 4, up->size);
+            putField(buffer, 8, up->appPort);
+            putString(buffer, 12, up->size, up->predecessor);
             break;
         }
         case MTYPE_UPDATE_PREDECESSOR_ACK:
         {
             UpdatePredcessorAck *upAck = (UpdatePredcessorAck *) msg;
-            ret = new unsigned char[upAck->size];
-            memcpy(ret, itobc(htonl(upAck->type)), 4);
-            memcpy(ret + 4, itobc(htonl(upAck->size)), 4);
-            memcpy(ret + 8, itobc(htonl(upAck->hashedId)), 4);
+            putField(buffer, 0, upAck->type);
+            putField(buffer, 4, upAck->size);
+            putField(buffer, 8, upAck->hashedId);
+            putHints(buffer, 12, upAck->hints);
             break;
         }
         case MTYPE_STABILIZE_REQUEST:
+        case MTYPE_FINGER_TABLE_REQUEST:
         {
             StabilizeRequest *streq = (StabilizeRequest *) msg;
-            ret = new unsigned char[streq->size];
-            memcpy(ret, itobc(htonl(streq->type)), 4);
-            memcpy(ret + 4, itobc(htonl(streq->size)), 4);
-            memcpy(ret + 8, itobc(htonl(streq->appPort)), 4);
-            if (streq->size - 12 > 0) {
-                memcpy(ret + 12, streq->sender, streq->size - 12);
-            }
+            putField(buffer, 0, streq->type);
+            putField(buffer, 4, streq->size);
+            putField(buffer, 8, streq->requestId);
+            putField(buffer, 12, streq->appPort);
+            putString(buffer, 16, streq->size, streq->sender);
             break;
         }
         case MTYPE_STABILIZE_RESPONSE:
         {
             StabilizeResponse *stres = (StabilizeResponse *) msg;
-            ret = new unsigned char[stres->size];
-            memcpy(ret, itobc(htonl(stres->type)), 4);
-            memcpy(ret + 4, itobc(htonl(stres->size)), 4);
-            memcpy(ret + 8, itobc(htonl(stres->appPort)), 4);
-            if (stres->size - 12 > 0) {
-                memcpy(ret + 12, stres->predecessor, stres->size - 12);
+            putField(buffer, 0, stres->type);
+            putField(buffer, 4, stres->size);
+            putField(buffer, 8, stres->requestId);
+            putField(buffer, 12, stres->appPort);
+            putField(buffer, 16, stres->successorCount);
+            
+            size_t offset = 20;
+            for (uint32_t i = 0; i < stres->successorCount; ++i) {
+                putField(buffer, offset, stres->successors[i].appPort);
+                memcpy(buffer + offset + 4, stres->successors[i].ipaddr, SUCCESSOR_IP_LEN);
+                offset += StabilizeResponseView::ENTRY;
             }
+            size_t end = stres->size - hintsLength(stres->hints);
+            putString(buffer, offset, end, stres->predecessor);
+            putHints(buffer, end, stres->hints);
+            break;
+        }
+        case MTYPE_FINGER_TABLE_RESPONSE:
+        {
+            FingerTableResponse *ftres = (FingerTableResponse *) msg;
+            putField(buffer, 0, ftres->type);
+            putField(buffer, 4, ftres->size);
+            putField(buffer, 8, ftres->appPort);
+            putField(buffer, 12, ftres->entryCount);
+            
+            size_t offset = 16;
+            for (uint32_t i = 0; i < ftres->entryCount; ++i) {
+                putField(buffer, offset, ftres->entries[i].appPort);
+                memcpy(buffer + offset + 4, ftres->entries[i].ipaddr, SUCCESSOR_IP_LEN);
+                offset += FingerTableResponseView::ENTRY;
+            }
+            putString(buffer, offset, ftres->size, ftres->responder);
+            break;
+        }
+        case MTYPE_PROBE:
+        case MTYPE_PROBE_ACK:
+        {
+            Probe *probe = (Probe *) msg;
+            putField(buffer, 0, probe->type);
+            putField(buffer, 4, probe->size);
+            putField(buffer, 8, probe->stamp);
+            putField(buffer, 12, probe->appPort);
+            putString(buffer, 16, probe->size, probe->sender);
             break;
         }
         case MTYPE_CHORD_MAP_QUERY:
         {
             ChordMapQuery *cmq = (ChordMapQuery *) msg;
-            ret = new unsigned char[cmq->size];
-            memcpy(ret, itobc(htonl(cmq->type)), 4);
-            memcpy(ret + 4, itobc(htonl(cmq->size)), 4);
-            memcpy(ret + 8, itobc(htonl(cmq->seq)), 4);
-            if (cmq->size - 12 > 0) {
-                memcpy(ret + 12, cmq->sender, cmq->size - 12);
-            }
+            putField(buffer, 0, cmq->type);
+            putField(buffer, 4, cmq->size);
+            putField(buffer, 8, cmq->seq);
+            putString(buffer, 12, cmq->size, cmq->sender);
             break;
         }
         case MTYPE_CHORD_MAP_RESPONSE:
         {
             ChordMapResponse *cmr = (ChordMapResponse *) msg;
-            ret = new unsigned char[cmr->size];
-            memcpy(ret, itobc(htonl(cmr->type)), 4);
-            memcpy(ret + 4, itobc(htonl(cmr->size)), 4);
-            memcpy(ret + 8, itobc(htonl(cmr->seq)), 4);
-            if (cmr->size - 12 > 0) {
-                memcpy(ret + 12, cmr->responder, cmr->size - 12);
-            }
+            putField(buffer, 0, cmr->type);
+            putField(buffer, 4, cmr->size);
+            putField(buffer, 8, cmr->seq);
+            putString(buffer, 12, cmr->size, cmr->responder);
             break;
         }
         case MTYPE_JOIN_SUCCESSOR_QUERY:
         case MTYPE_FINGER_QUERY:
         case MTYPE_SUCCESSOR_QUERY:
+        case MTYPE_NEXT_HOP_QUERY:
         {
             SuccessorQuery *squery = (SuccessorQuery *) msg;
-            ret = new unsigned char[squery->size];
-            memcpy(ret, itobc(htonl(squery->type)), 4);
-            memcpy(ret + 4, itobc(htonl(squery->size)), 4);
-            memcpy(ret + 8, itobc(htonl(squery->searchTerm)), 4);
-            memcpy(ret + 12, itobc(htonl(squery->appPort)), 4);
-            if (squery->size - 16 > 0) {
-                memcpy(ret + 16, squery->sender, squery->size - 16);
-            }
+            putField(buffer, 0, squery->type);
+            putField(buffer, 4, squery->size);
+            putField(buffer, 8, squery->searchTerm);
+            putField(buffer, 12, squery->requestId);
+            putField(buffer, 16, squery->appPort);
+            putString(buffer, 20, squery->size, squery->sender);
             break;
         }
         case MTYPE_FINGER_RESPONSE:
         case MTYPE_SUCCESSOR_RESPONSE:
+        case MTYPE_NEXT_HOP_RESPONSE:
         {
             SuccessorResponse *sqr = (SuccessorResponse *) msg;
-            ret = new unsigned char[sqr->size];
-            memcpy(ret, itobc(htonl(sqr->type)), 4);
-            memcpy(ret + 4, itobc(htonl(sqr->size)), 4);
-            memcpy(ret + 8, itobc(htonl(sqr->searchTerm)), 4);
-            memcpy(ret + 12, itobc(htonl(sqr->appPort)), 4);
-            if (sqr->size - 16 > 0) {
-                memcpy(ret + 16, sqr->responder, sqr->size - 16);
-            }
+            putField(buffer, 0, sqr->type);
+            putField(buffer, 4, sqr->size);
+            putField(buffer, 8, sqr->searchTerm);
+            putField(buffer, 12, sqr->requestId);
+            putField(buffer, 16, sqr->rangeStart);
+            putField(buffer, 20, sqr->appPort);
+            size_t end = sqr->size - hintsLength(sqr->hints);
+            putString(buffer, 24, end, sqr->responder);
+            putHints(buffer, end, sqr->hints);
             break;
         }
         default:
             cerr << "Cannot identify message type: " << MessageHandler::getType(msg) << endl;
+            return 0;
     }
     
-    return ret;
+    return size;
+}
+
+/**
+ * Checks that a received byte array is a complete message of a known type:
+ * the size field matches what was received, all fixed fields are present and
+ * the trailing IP address string is NUL-terminated within the message.
+ * Messages that pass can be read with the views in MessageViews.hpp
+ * 
+ * @param   byteStream  The received byte array
+ * @param   len         Number of bytes received
+ * @return  True if the message is well formed, false otherwise
+ */
+bool MessageHandler::validate(const unsigned char *byteStream, size_t len) {
+    MessageView msg(byteStream, len);
+    if (len < sizeof(BaseMessage) || msg.getSize() < sizeof(BaseMessage) || msg.getSize() > len) {
+        return false;
+    }
+    
+    switch (msg.getType()) {
+        case MTYPE_UPDATE_PREDECESSOR:
+            return UpdatePredecessorView(byteStream, len).predecessor() != NULL;
+        case MTYPE_UPDATE_PREDECESSOR_ACK:
+            return msg.getSize() >= 12;
+        case MTYPE_STABILIZE_REQUEST:
+        case MTYPE_FINGER_TABLE_REQUEST:
+            return StabilizeRequestView(byteStream, len).sender() != NULL;
+        case MTYPE_STABILIZE_RESPONSE:
+        {
+            StabilizeResponseView stres(byteStream, len);
+            if (msg.getSize() < 20 || stres.predecessor() == NULL) {
+                return false;
+            }
+            
+            for (uint32_t i = 0; i < stres.successorCount(); ++i) {
+                if (stres.successorIp(i) == NULL) {
+                    return false;
+                }
+            }
+            
+            return true;
+        }
+        case MTYPE_FINGER_TABLE_RESPONSE:
+        {
+            FingerTableResponseView ftres(byteStream, len);
+            if (msg.getSize() < 16 || ftres.responder() == NULL) {
+                return false;
+            }
+            
+            for (uint32_t i = 0; i < ftres.entryCount(); ++i) {
+                if (ftres.entryIp(i) == NULL) {
+                    return false;
+                }
+            }
+            
+            return true;
+        }
+        case MTYPE_PROBE:
+        case MTYPE_PROBE_ACK:
+            return ProbeView(byteStream, len).sender() != NULL;
+        case MTYPE_CHORD_MAP_QUERY:
+            return ChordMapQueryView(byteStream, len).sender() != NULL;
+        case MTYPE_CHORD_MAP_RESPONSE:
+            return ChordMapResponseView(byteStream, len).responder() != NULL;
+        case MTYPE_JOIN_SUCCESSOR_QUERY:
+        case MTYPE_FINGER_QUERY:
+        case MTYPE_SUCCESSOR_QUERY:
+        case MTYPE_NEXT_HOP_QUERY:
+            return SuccessorQueryView(byteStream, len).sender() != NULL;
+        case MTYPE_FINGER_RESPONSE:
+        case MTYPE_SUCCESSOR_RESPONSE:
+        case MTYPE_NEXT_HOP_RESPONSE:
+            return SuccessorResponseView(byteStream, len).responder() != NULL;
+        default:
+            return false;
+    }
 }
 
 /**
@@ -160,14 +327,16 @@ void *MessageHandler::unserialize(unsigned char *byteStream) {
             return upAck;
         }
         case MTYPE_STABILIZE_REQUEST:
+        case MTYPE_FINGER_TABLE_REQUEST:
         {
             StabilizeRequest *streq = new StabilizeRequest();
-            streq->type = MTYPE_STABILIZE_REQUEST;
+            streq->type = ntohl(bctoi(byteStream));
             streq->size = ntohl(bctoi(byteStream + 4));
-            streq->appPort = ntohl(bctoi(byteStream + 8));
-            if (streq->size - 12 > 0) {
-                streq->sender = new char[streq->size - 12];
-                memcpy(streq->sender, byteStream + 12, streq->size - 12);
+            streq->requestId = ntohl(bctoi(byteStream + 8));
+            streq->appPort = ntohl(bctoi(byteStream + 12));
+            if (streq->size - 16 > 0) {
+                streq->sender = new char[streq->size - 16];
+                memcpy(streq->sender, byteStream + 16, streq->size - 16);
             } else {
                 streq->sender = NULL;
             }
@@ -179,16 +348,72 @@ void *MessageHandler::unserialize(unsigned char *byteStream) {
             StabilizeResponse *stres = new StabilizeResponse();
             stres->type = MTYPE_STABILIZE_RESPONSE;
             stres->size = ntohl(bctoi(byteStream + 4));
-            stres->appPort  = ntohl(bctoi(byteStream + 8));
-            if (stres->size - 12 > 0) {
-                stres->predecessor = new char[stres->size - 12];
-                memcpy(stres->predecessor, byteStream + 12, stres->size - 12);
+            stres->requestId = ntohl(bctoi(byteStream + 8));
+            stres->appPort  = ntohl(bctoi(byteStream + 12));
+            stres->successorCount = ntohl(bctoi(byteStream + 16));
+            if (stres->successorCount > MAX_SUCCESSORS) {
+                stres->successorCount = 0;
+            }
+            
+            size_t offset = 20;
+            for (uint32_t i = 0; i < stres->successorCount; ++i) {
+                stres->successors[i].appPort = ntohl(bctoi(byteStream + offset));
+                memcpy(stres->successors[i].ipaddr, byteStream + offset + 4, SUCCESSOR_IP_LEN);
+                offset += StabilizeResponseView::ENTRY;
+            }
+            
+            if (stres->size > offset) {
+                stres->predecessor = new char[stres->size - offset];
+                memcpy(stres->predecessor, byteStream + offset, stres->size - offset);
             } else {
                 stres->predecessor = NULL;
             }
             
             return stres;
         }
+        case MTYPE_FINGER_TABLE_RESPONSE:
+        {
+            FingerTableResponse *ftres = new FingerTableResponse();
+            ftres->type = MTYPE_FINGER_TABLE_RESPONSE;
+            ftres->size = ntohl(bctoi(byteStream + 4));
+            ftres->appPort = ntohl(bctoi(byteStream + 8));
+            ftres->entryCount = ntohl(bctoi(byteStream + 12));
+            if (ftres->entryCount > MAX_FINGER_ENTRIES) {
+                ftres->entryCount = 0;
+            }
+            
+            size_t offset = 16;
+            for (uint32_t i = 0; i < ftres->entryCount; ++i) {
+                ftres->entries[i].appPort = ntohl(bctoi(byteStream + offset));
+                memcpy(ftres->entries[i].ipaddr, byteStream + offset + 4, SUCCESSOR_IP_LEN);
+                offset += FingerTableResponseView::ENTRY;
+            }
+            
+            if (ftres->size > offset) {
+                ftres->responder = new char[ftres->size - offset];
+                memcpy(ftres->responder, byteStream + offset, ftres->size - offset);
+            } else {
+                ftres->responder = NULL;
+            }
+            
+            return ftres;
+        }
+        case MTYPE_PROBE:
+        case MTYPE_PROBE_ACK:
+        {
+            Probe *probe = new Probe();
+            probe->type = ntohl(bctoi(byteStream));
+            probe->size = ntohl(bctoi(byteStream + 4));
+            probe->stamp = ntohl(bctoi(byteStream + 8));
+            probe->appPort = ntohl(bctoi(byteStream + 12));
+            if (probe->size - 16 > 0) {
+                probe->sender = new char[probe->size - 16];
+                memcpy(probe->sender, byteStream + 16, probe->size - 16);
+            } else {
+                probe->sender = NULL;
+            }
+            return probe;
+        }
         case MTYPE_CHORD_MAP_QUERY:
         {
             ChordMapQuery *cmq = new ChordMapQuery();
@@ -220,15 +445,17 @@ void *MessageHandler::unserialize(unsigned char *byteStream) {
         case MTYPE_JOIN_SUCCESSOR_QUERY:
         case MTYPE_FINGER_QUERY:
         case MTYPE_SUCCESSOR_QUERY:
+        case MTYPE_NEXT_HOP_QUERY:
         {
             SuccessorQuery *squery = new SuccessorQuery();
             squery->type = ntohl(bctoi(byteStream));
             squery->size = ntohl(bctoi(byteStream + 4));
             squery->searchTerm = ntohl(bctoi(byteStream + 8));
-            squery->appPort = ntohl(bctoi(byteStream + 12));
-            if (squery->size - 16 > 0) {
-                squery->sender = new char[squery->size - 16];
-                memcpy(squery->sender, byteStream + 16, squery->size - 16);
+            squery->requestId = ntohl(bctoi(byteStream + 12));
+            squery->appPort = ntohl(bctoi(byteStream + 16));
+            if (squery->size - 20 > 0) {
+                squery->sender = new char[squery->size - 20];
+                memcpy(squery->sender, byteStream + 20, squery->size - 20);
             } else {
                 squery->sender = NULL;
             }
@@ -236,15 +463,18 @@ void *MessageHandler::unserialize(unsigned char *byteStream) {
         }
         case MTYPE_FINGER_RESPONSE:
         case MTYPE_SUCCESSOR_RESPONSE:
+        case MTYPE_NEXT_HOP_RESPONSE:
         {
             SuccessorResponse *sqr = new SuccessorResponse();
             sqr->type = ntohl(bctoi(byteStream));
             sqr->size = ntohl(bctoi(byteStream + 4));
             sqr->searchTerm = ntohl(bctoi(byteStream + 8));
-            sqr->appPort = ntohl(bctoi(byteStream + 12));
-            if (sqr->size - 16 > 0) {
-                sqr->responder = new char[sqr->size - 16];
-                memcpy(sqr->responder, byteStream + 16, sqr->size - 16);
+            sqr->requestId = ntohl(bctoi(byteStream + 12));
+            sqr->rangeStart = ntohl(bctoi(byteStream + 16));
+            sqr->appPort = ntohl(bctoi(byteStream + 20));
+            if (sqr->size - 24 > 0) {
+                sqr->responder = new char[sqr->size - 24];
+                memcpy(sqr->responder, byteStream + 24, sqr->size - 24);
             } else {
                 sqr->responder = NULL;
             }
@@ -256,31 +486,35 @@ void *MessageHandler::unserialize(unsigned char *byteStream) {
     }
 }
 
-SuccessorQuery *MessageHandler::createSuccessorQuery(uint32_t searchTerm, uint32_t appPort, char *sender) {
+SuccessorQuery *MessageHandler::createSuccessorQuery(uint32_t searchTerm, uint32_t appPort, const char *sender, uint32_t requestId) {
     SuccessorQuery *sq = new SuccessorQuery();
     sq->type = MTYPE_SUCCESSOR_QUERY;
-    sq->size = 16 + strlen(sender) + 1;
+    sq->size = 20 + strlen(sender) + 1;
     sq->searchTerm = searchTerm;
+    sq->requestId = requestId;
     sq->appPort = appPort;
-    sq->sender = new char[sq->size - 16];
+    sq->sender = new char[sq->size - 20];
     strcpy(sq->sender, sender);
     
     return sq;
 }
 
-SuccessorResponse *MessageHandler::createSuccessorResponse(uint32_t searchTerm, uint32_t appPort, char *responder) {
+SuccessorResponse *MessageHandler::createSuccessorResponse(uint32_t searchTerm, uint32_t appPort, const char *responder,
+        uint32_t requestId, uint32_t rangeStart) {
     SuccessorResponse *sqr = new SuccessorResponse();
     sqr->type = MTYPE_SUCCESSOR_RESPONSE;
-    sqr->size = 16 + strlen(responder) + 1;
+    sqr->size = 24 + strlen(responder) + 1;
     sqr->searchTerm = searchTerm;
+    sqr->requestId = requestId;
+    sqr->rangeStart = rangeStart;
     sqr->appPort = appPort;
-    sqr->responder = new char[sqr->size - 16];
+    sqr->responder = new char[sqr->size - 24];
     strcpy(sqr->responder, responder);
     
     return sqr;
 }
 
-ChordMapQuery *MessageHandler::createChordMapQuery(uint32_t seq, char *sender) {
+ChordMapQuery *MessageHandler::createChordMapQuery(uint32_t seq, const char *sender) {
     ChordMapQuery *cmq = new ChordMapQuery();
     cmq->type = MTYPE_CHORD_MAP_QUERY;
     cmq->size = 12 + strlen(sender) + 1;
@@ -291,7 +525,7 @@ ChordMapQuery *MessageHandler::createChordMapQuery(uint32_t seq, char *sender) {
     return cmq;
 }
 
-ChordMapResponse *MessageHandler::createChordMapResponse(uint32_t seq, char *responder) {
+ChordMapResponse *MessageHandler::createChordMapResponse(uint32_t seq, const char *responder) {
     ChordMapResponse *cmr = new ChordMapResponse();
     cmr->type = MTYPE_CHORD_MAP_RESPONSE;
     cmr->size = 12 + strlen(responder) + 1;
@@ -302,7 +536,7 @@ ChordMapResponse *MessageHandler::createChordMapResponse(uint32_t seq, char *res
     return cmr;
 }
 
-UpdatePredcessor *MessageHandler::createUpdatePredecessor(uint32_t appPort, char *predecessor) {
+UpdatePredcessor *MessageHandler::createUpdatePredecessor(uint32_t appPort, const char *predecessor) {
     UpdatePredcessor *up = new UpdatePredcessor();
     up->type = MTYPE_UPDATE_PREDECESSOR;
     up->size = 12 + strlen(predecessor) + 1;
@@ -322,28 +556,238 @@ UpdatePredcessorAck *MessageHandler::createUpdatePredecessorAck(uint32_t hashedI
     return upAck;
 }
 
-StabilizeRequest *MessageHandler::createStabilizeRequest(uint32_t appPort, char *sender) {
+StabilizeRequest *MessageHandler::createStabilizeRequest(uint32_t appPort, const char *sender, uint32_t requestId) {
     StabilizeRequest *streq = new StabilizeRequest();
     streq->type = MTYPE_STABILIZE_REQUEST;
-    streq->size = 12 + strlen(sender) + 1;
+    streq->size = 16 + strlen(sender) + 1;
+    streq->requestId = requestId;
     streq->appPort = appPort;
-    streq->sender = new char[streq->size - 12];
+    streq->sender = new char[streq->size - 16];
     strcpy(streq->sender, sender);
     
     return streq;
 }
 
-StabilizeResponse *MessageHandler::createStabilizeResponse(uint32_t appPort, char *predecessor) {
+StabilizeResponse *MessageHandler::createStabilizeResponse(uint32_t appPort, const char *predecessor, uint32_t requestId) {
     StabilizeResponse *stres = new StabilizeResponse();
     stres->type = MTYPE_STABILIZE_RESPONSE;
-    stres->size = 12 + strlen(predecessor) + 1;
+    stres->size = 20 + strlen(predecessor) + 1;
+    stres->requestId = requestId;
     stres->appPort = appPort;
-    stres->predecessor = new char[stres->size - 12];
+    stres->successorCount = 0;
+    stres->predecessor = new char[stres->size - 20];
     strcpy(stres->predecessor, predecessor);
     
     return stres;
 }
 
+/**
+ * Builds a SuccessorResponse by value. Unlike createSuccessorResponse(), nothing is
+ * allocated: responder is borrowed and must outlive the returned message
+ */
+SuccessorResponse MessageHandler::makeSuccessorResponse(uint32_t searchTerm, uint32_t appPort, const char *responder,
+        uint32_t requestId, uint32_t rangeStart) {
+    SuccessorResponse sqr;
+    sqr.type = MTYPE_SUCCESSOR_RESPONSE;
+    sqr.size = 24 + strlen(responder) + 1;
+    sqr.searchTerm = searchTerm;
+    sqr.requestId = requestId;
+    sqr.rangeStart = rangeStart;
+    sqr.appPort = appPort;
+    sqr.responder = (char *) responder;
+    sqr.hints.count = 0;
+    
+    return sqr;
+}
+
+/**
+ * Builds a SuccessorQuery by value; sender is borrowed
+ */
+SuccessorQuery MessageHandler::makeSuccessorQuery(uint32_t searchTerm, uint32_t appPort, const char *sender, uint32_t requestId) {
+    SuccessorQuery sq;
+    sq.type = MTYPE_SUCCESSOR_QUERY;
+    sq.size = 20 + strlen(sender) + 1;
+    sq.searchTerm = searchTerm;
+    sq.requestId = requestId;
+    sq.appPort = appPort;
+    sq.sender = (char *) sender;
+    
+    return sq;
+}
+
+/**
+ * Builds a StabilizeRequest by value; sender is borrowed
+ */
+StabilizeRequest MessageHandler::makeStabilizeRequest(uint32_t appPort, const char *sender, uint32_t requestId) {
+    StabilizeRequest streq;
+    streq.type = MTYPE_STABILIZE_REQUEST;
+    streq.size = 16 + strlen(sender) + 1;
+    streq.requestId = requestId;
+    streq.appPort = appPort;
+    streq.sender = (char *) sender;
+    
+    return streq;
+}
+
+/**
+ * Builds an UpdatePredcessor by value; predecessor is borrowed
+ */
+UpdatePredcessor MessageHandler::makeUpdatePredecessor(uint32_t appPort, const char *predecessor) {
+    UpdatePredcessor up;
+    up.type = MTYPE_UPDATE_PREDECESSOR;
+    up.size = 12 + strlen(predecessor) + 1;
+    up.appPort = appPort;
+    up.predecessor = (char *) predecessor;
+    
+    return up;
+}
+
+/**
+ * Builds a Probe by value; sender is borrowed
+ */
+Probe MessageHandler::makeProbe(uint32_t stamp, uint32_t appPort, const char *sender) {
+    Probe probe;
+    probe.type = MTYPE_PROBE;
+    probe.size = 16 + strlen(sender) + 1;
+    probe.stamp = stamp;
+    probe.appPort = appPort;
+    probe.sender = (char *) sender;
+    
+    return probe;
+}
+
+/**
+ * Builds a ChordMapQuery by value; sender is borrowed
+ */
+ChordMapQuery MessageHandler::makeChordMapQuery(uint32_t seq, const char *sender) {
+    ChordMapQuery cmq;
+    cmq.type = MTYPE_CHORD_MAP_QUERY;
+    cmq.size = 12 + strlen(sender) + 1;
+    cmq.seq = seq;
+    cmq.sender = (char *) sender;
+    
+    return cmq;
+}
+
+/**
+ * Builds a ChordMapResponse by value; responder is borrowed
+ */
+ChordMapResponse MessageHandler::makeChordMapResponse(uint32_t seq, const char *responder) {
+    ChordMapResponse cmr;
+    cmr.type = MTYPE_CHORD_MAP_RESPONSE;
+    cmr.size = 12 + strlen(responder) + 1;
+    cmr.seq = seq;
+    cmr.responder = (char *) responder;
+    
+    return cmr;
+}
+
+/**
+ * Builds an UpdatePredcessorAck by value
+ */
+UpdatePredcessorAck MessageHandler::makeUpdatePredecessorAck(uint32_t hashedId) {
+    UpdatePredcessorAck upAck;
+    upAck.type = MTYPE_UPDATE_PREDECESSOR_ACK;
+    upAck.size = 12;
+    upAck.hashedId = hashedId;
+    upAck.hints.count = 0;
+    
+    return upAck;
+}
+
+/**
+ * Builds a StabilizeResponse by value; predecessor is borrowed
+ */
+StabilizeResponse MessageHandler::makeStabilizeResponse(uint32_t appPort, const char *predecessor, uint32_t requestId) {
+    StabilizeResponse stres;
+    stres.type = MTYPE_STABILIZE_RESPONSE;
+    stres.size = 20 + strlen(predecessor) + 1;
+    stres.requestId = requestId;
+    stres.appPort = appPort;
+    stres.successorCount = 0;
+    stres.predecessor = (char *) predecessor;
+    stres.hints.count = 0;
+    
+    return stres;
+}
+
+/**
+ * Appends an entry to the successor list of a StabilizeResponse
+ * 
+ * @return  False if the list is full or the address does not fit
+ */
+bool MessageHandler::addSuccessor(StabilizeResponse &stres, uint32_t appPort, const char *ipaddr) {
+    if (stres.successorCount >= MAX_SUCCESSORS || strlen(ipaddr) >= SUCCESSOR_IP_LEN) {
+        return false;
+    }
+    
+    SuccessorEntry &entry = stres.successors[stres.successorCount++];
+    entry.appPort = appPort;
+    memset(entry.ipaddr, 0, SUCCESSOR_IP_LEN);
+    strcpy(entry.ipaddr, ipaddr);
+    stres.size += StabilizeResponseView::ENTRY;
+    
+    return true;
+}
+
+/**
+ * Appends a peer to the routing hints of a message
+ * 
+ * @param   hints   The hints of the message; their flags and senderId are set by the caller
+ * @param   size    The size of the message, grown to take the hint
+ * @return  False if the hints are full or the address does not fit
+ */
+bool MessageHandler::addHint(RoutingHints &hints, uint32_t &size, uint32_t appPort, const char *ipaddr) {
+    if (hints.count >= MAX_HINTS || strlen(ipaddr) >= SUCCESSOR_IP_LEN) {
+        return false;
+    }
+    
+    if (hints.count == 0) {
+        size += 12;
+    }
+    
+    SuccessorEntry &entry = hints.entries[hints.count++];
+    entry.appPort = appPort;
+    memset(entry.ipaddr, 0, SUCCESSOR_IP_LEN);
+    strcpy(entry.ipaddr, ipaddr);
+    size += MessageView::HINT_ENTRY;
+    
+    return true;
+}
+
+/**
+ * Builds an empty FingerTableResponse by value; responder is borrowed
+ */
+FingerTableResponse MessageHandler::makeFingerTableResponse(uint32_t appPort, const char *responder) {
+    FingerTableResponse ftres;
+    ftres.type = MTYPE_FINGER_TABLE_RESPONSE;
+    ftres.size = 16 + strlen(responder) + 1;
+    ftres.appPort = appPort;
+    ftres.entryCount = 0;
+    ftres.responder = (char *) responder;
+    
+    return ftres;
+}
+
+/**
+ * Appends a node to a FingerTableResponse
+ * 
+ * @return  False if the response is full or the address does not fit
+ */
+bool MessageHandler::addFingerEntry(FingerTableResponse &ftres, uint32_t appPort, const char *ipaddr) {
+    if (ftres.entryCount >= MAX_FINGER_ENTRIES || strlen(ipaddr) >= SUCCESSOR_IP_LEN) {
+        return false;
+    }
+    
+    SuccessorEntry &entry = ftres.entries[ftres.entryCount++];
+    entry.appPort = appPort;
+    memset(entry.ipaddr, 0, SUCCESSOR_IP_LEN);
+    strcpy(entry.ipaddr, ipaddr);
+    ftres.size += FingerTableResponseView::ENTRY;
+    
+    return true;
+}
+
 /**
  * Returns the size of the received byte array
  */
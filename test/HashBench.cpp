@@ -0,0 +1,91 @@
+#include <cmath>
+#include <cstdio>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <gmp.h>
+#include <openssl/sha.h>
+
+#include "../include/Chord.hpp"
+#include "../include/Utils.hpp"
+
+using namespace std;
+
+const unsigned int KEYS = 200000;
+
+/**
+ * The ring ID as getConsistentHash computed it before it reduced the digest
+ * directly: hex string, parsed by GMP, modulo 2^CHORD_LENGTH_BIT
+ */
+static unsigned int gmpConsistentHash(const char *tohash, size_t len) {
+    unsigned char *hash = new unsigned char[160];
+    SHA1((const unsigned char *) tohash, len, hash);
+    
+    stringstream ss;
+    for (int i = 0; i < 20; ++i) {
+        ss << hex << setw(2) << setfill('0') << (int) hash[i];
+    }
+    
+    mpz_t chash, largenum;
+    mpz_inits(chash, largenum, NULL);
+    char *str = cstr(ss.str());
+    mpz_set_str(largenum, str, 16);
+    mpz_mod_ui(chash, largenum, pow((long double) 2, (long double) CHORD_LENGTH_BIT));
+    
+    unsigned int pos = (unsigned int) mpz_get_ui(chash);
+    mpz_clears(chash, largenum, NULL);
+    delete[] str;
+    delete[] hash;
+    
+    return pos;
+}
+
+/**
+ * Checks that Chord::getHashedKey gives the same IDs as the GMP path, then
+ * compares how long each takes per key
+ */
+int main() {
+    Chord chord(5000, 45000, (char *) "127.0.0.1");
+    
+    vector<string> keys;
+    for (unsigned int i = 0; i < KEYS; ++i) {
+        stringstream ss;
+        ss << "key-" << i << "-" << string(i % 97, 'x');
+        keys.push_back(ss.str());
+    }
+    
+    unsigned int mismatches = 0;
+    for (unsigned int i = 0; i < KEYS; ++i) {
+        char *key = (char *) keys[i].c_str();
+        if (chord.getHashedKey(key) != gmpConsistentHash(key, keys[i].size() + 1)) {
+            ++mismatches;
+        }
+    }
+    
+    if (mismatches > 0) {
+        printf("FAIL: %u of %u IDs differ from the GMP path\n", mismatches, KEYS);
+        return 1;
+    }
+    
+    // Summed so that the calls cannot be optimized away
+    unsigned int sum = 0;
+    unsigned long int start = getTimeInUSeconds();
+    for (unsigned int i = 0; i < KEYS; ++i) {
+        sum += gmpConsistentHash(keys[i].c_str(), keys[i].size() + 1);
+    }
+    unsigned long int gmpTime = getTimeInUSeconds() - start;
+    
+    start = getTimeInUSeconds();
+    for (unsigned int i = 0; i < KEYS; ++i) {
+        sum += chord.getHashedKey((char *) keys[i].c_str());
+    }
+    unsigned long int directTime = getTimeInUSeconds() - start;
+    
+    printf("getConsistentHash, %u keys (checksum %u)\n", KEYS, sum);
+    printf("  GMP path:          %8.1f ns/key\n", gmpTime * 1000.0 / KEYS);
+    printf("  digest reduction:  %8.1f ns/key\n", directTime * 1000.0 / KEYS);
+    
+    return 0;
+}
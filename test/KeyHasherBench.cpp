@@ -0,0 +1,55 @@
+#include <cstdio>
+#include <vector>
+
+#include <openssl/sha.h>
+
+#include "../include/KeyHasher.hpp"
+#include "../include/Utils.hpp"
+
+using namespace std;
+
+const unsigned int KEYS = 1 << 20;
+const unsigned int BATCH = 256;
+
+/**
+ * Times hashing KEYS keys of the given length in batches of BATCH
+ * 
+ * @return  Millions of keys per second
+ */
+static double run(bool scalar, size_t len) {
+    vector<unsigned char> data(BATCH * len + 1, 'k');
+    vector<const unsigned char *> keys(BATCH);
+    vector<size_t> lens(BATCH, len);
+    for (unsigned int i = 0; i < BATCH; ++i) {
+        keys[i] = &data[i * len];
+        data[i * len] = (unsigned char) i;
+    }
+    
+    unsigned char digests[BATCH][SHA_DIGEST_LENGTH];
+    unsigned long int start = getTimeInUSeconds();
+    for (unsigned int done = 0; done < KEYS; done += BATCH) {
+        if (scalar) {
+            KeyHasher::sha1Scalar(&keys[0], &lens[0], BATCH, digests);
+        } else {
+            KeyHasher::sha1(&keys[0], &lens[0], BATCH, digests);
+        }
+    }
+    
+    return KEYS / (double) (getTimeInUSeconds() - start);
+}
+
+/**
+ * Compares the multi-buffer path to hashing one key at a time with OpenSSL
+ */
+int main() {
+    printf("KeyHasher, %u keys in batches of %u: %s, %u lanes\n", KEYS, BATCH,
+            KeyHasher::getImplementation(), KeyHasher::getLanes());
+    printf("  key bytes   scalar Mkeys/s   multi-buffer Mkeys/s\n");
+    
+    size_t sizes[] = { 8, 16, 32, 64, 128 };
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        printf("  %9lu   %14.2f   %20.2f\n", (unsigned long) sizes[i], run(true, sizes[i]), run(false, sizes[i]));
+    }
+    
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+
+#include <openssl/sha.h>
+
+#include "../include/Chord.hpp"
+#include "../include/KeyHasher.hpp"
+
+using namespace std;
+
+// Longest key tried; covers keys spanning up to five SHA-1 blocks
+const unsigned int MAX_KEY = 300;
+
+/**
+ * Hashes count keys with KeyHasher and compares every digest to OpenSSL's SHA1()
+ * 
+ * @return  Number of digests that differ
+ */
+static unsigned int check(const vector<vector<unsigned char> > &keys, unsigned int first, unsigned int count) {
+    vector<const unsigned char *> ptrs(count);
+    vector<size_t> lens(count);
+    for (unsigned int i = 0; i < count; ++i) {
+        ptrs[i] = keys[first + i].empty() ? (const unsigned char *) "" : &(keys[first + i][0]);
+        lens[i] = keys[first + i].size();
+    }
+    
+    unsigned char (*simd)[SHA_DIGEST_LENGTH] = new unsigned char[count][SHA_DIGEST_LENGTH];
+    unsigned char (*scalar)[SHA_DIGEST_LENGTH] = new unsigned char[count][SHA_DIGEST_LENGTH];
+    KeyHasher::sha1(&ptrs[0], &lens[0], count, simd);
+    KeyHasher::sha1Scalar(&ptrs[0], &lens[0], count, scalar);
+    
+    unsigned int failures = 0;
+    for (unsigned int i = 0; i < count; ++i) {
+        unsigned char expected[SHA_DIGEST_LENGTH];
+        SHA1(ptrs[i], lens[i], expected);
+        
+        if (memcmp(simd[i], expected, SHA_DIGEST_LENGTH) != 0 || memcmp(scalar[i], expected, SHA_DIGEST_LENGTH) != 0) {
+            printf("  digest of key %u (%lu bytes) differs\n", first + i, (unsigned long) lens[i]);
+            ++failures;
+        }
+    }
+    
+    delete[] simd;
+    delete[] scalar;
+    return failures;
+}
+
+/**
+ * Checks that KeyHasher gives the same digests as OpenSSL for every key length
+ * up to MAX_KEY, in batches of every size up to a few times the lane count,
+ * and that Chord::getHashedKeys agrees with getHashedKey
+ */
+int main() {
+    printf("KeyHasher: %s, %u lanes\n", KeyHasher::getImplementation(), KeyHasher::getLanes());
+    srand(1);
+    
+    // Every length, in an order that mixes short and long keys in the lanes
+    vector<vector<unsigned char> > keys;
+    for (unsigned int len = 0; len <= MAX_KEY; ++len) {
+        vector<unsigned char> key((len * 7919) % (MAX_KEY + 1));
+        for (unsigned int i = 0; i < key.size(); ++i) {
+            key[i] = (unsigned char) rand();
+        }
+        keys.push_back(key);
+    }
+    
+    unsigned int failures = check(keys, 0, keys.size());
+    for (unsigned int count = 1; count <= 3 * KeyHasher::getLanes() + 1; ++count) {
+        for (unsigned int first = 0; first + count <= keys.size(); first += count) {
+            failures += check(keys, first, count);
+        }
+    }
+    
+    Chord chord(5000, 45000, (char *) "127.0.0.1");
+    vector<char *> names;
+    for (unsigned int i = 0; i < 1000; ++i) {
+        char *name = new char[32];
+        snprintf(name, 32, "key%u", i);
+        names.push_back(name);
+    }
+    
+    vector<unsigned int> ids = chord.getHashedKeys(names);
+    for (unsigned int i = 0; i < names.size(); ++i) {
+        if (ids.size() != names.size() || ids[i] != chord.getHashedKey(names[i])) {
+            printf("  getHashedKeys differs from getHashedKey for %s\n", names[i]);
+            ++failures;
+        }
+        delete[] names[i];
+    }
+    
+    printf("%s: %u failures\n", failures == 0 ? "PASS" : "FAIL", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include "../include/Chord.hpp"
+#include "../include/Utils.hpp"
+
+using namespace std;
+
+const unsigned int NODES = 6;
+const unsigned int CHORD_PORT = 45000;
+const unsigned int APP_PORT = 5000;
+const unsigned int KEYS = 200;
+// How long lookups may take to settle after the ring forms
+const unsigned long int SETTLE_TIMEOUT = 20000000;  // 20 seconds
+// How long they may take to route around a node that died: the next finger refresh
+// probes it, and gives up on it once the probe and its retry go unanswered
+const unsigned long int RECOVERY_TIMEOUT = 2 * PERIODIC_JOBS_TIMEOUT + (PROBE_RETRIES + 1) * SUCCESSOR_TIMEOUT + 2000000;  // 6 seconds
+// How long lookups must keep returning the right owner once they do, spanning
+// several stabilize rounds at the longest interval
+const unsigned long int HOLD_TIME = 3 * MAX_STABILIZE_INTERVAL;
+
+/**
+ * Looks up every key from every live node
+ *
+ * @param   ring    Hashed ID and application port of every live node, in ID order
+ * @return  How many lookups did not return the node that owns the key
+ */
+static unsigned int checkLookups(const vector<Chord *> &nodes, const vector<bool> &live,
+        const vector<pair<unsigned int, unsigned int> > &ring, const vector<char *> &keys) {
+    unsigned int wrong = 0;
+    for (unsigned int i = 0; i < nodes.size(); ++i) {
+        if (!live[i]) {
+            continue;
+        }
+        
+        vector<QueryResult> results = nodes[i]->queryBatch(keys, 1000);
+        for (unsigned int k = 0; k < results.size(); ++k) {
+            unsigned int id = nodes[i]->getHashedKey(keys[k]);
+            vector<pair<unsigned int, unsigned int> >::const_iterator owner = lower_bound(ring.begin(), ring.end(), make_pair(id, 0u));
+            if (owner == ring.end()) {
+                owner = ring.begin();
+            }
+            
+            if (results[k].hostip == NULL || results[k].port != owner->second) {
+                ++wrong;
+            }
+            delete[] results[k].hostip;
+        }
+    }
+    
+    return wrong;
+}
+
+/**
+ * Looks up the keys until every lookup returns the right owner
+ *
+ * @return  How long that took in microseconds; timeout if it never happened
+ */
+static unsigned long int waitForOwners(const vector<Chord *> &nodes, const vector<bool> &live,
+        const vector<pair<unsigned int, unsigned int> > &ring, const vector<char *> &keys, unsigned long int timeout) {
+    unsigned long int start = getTimeInUSeconds();
+    while (getTimeInUSeconds() - start < timeout) {
+        if (checkLookups(nodes, live, ring, keys) == 0) {
+            return getTimeInUSeconds() - start;
+        }
+        usleep(100000);
+    }
+    
+    return timeout;
+}
+
+/**
+ * Forms a ring on loopback addresses, stops one node and checks that lookups
+ * from the others return the right owner soon after, and keep doing so
+ */
+int main() {
+    vector<Chord *> nodes;
+    vector<bool> live(NODES, true);
+    vector<pair<unsigned int, unsigned int> > ring;
+    vector<char *> addresses;
+    
+    for (unsigned int i = 0; i < NODES; ++i) {
+        char *ip = new char[INET_ADDRSTRLEN];
+        snprintf(ip, INET_ADDRSTRLEN, "127.0.0.%u", i + 1);
+        addresses.push_back(ip);
+        
+        Chord *chord = new Chord(APP_PORT + i, CHORD_PORT, ip);
+        chord->setJoinPointIp((i == 0) ? NULL : addresses[0]);
+        if (!chord->init() || !chord->start()) {
+            printf("FAIL: node %s did not start: %s\n", ip, chord->getError());
+            return 1;
+        }
+        
+        nodes.push_back(chord);
+        ring.push_back(make_pair(chord->getHashedKey(ip), APP_PORT + i));
+    }
+    sort(ring.begin(), ring.end());
+    
+    vector<char *> keys;
+    for (unsigned int k = 0; k < KEYS; ++k) {
+        char *key = new char[32];
+        snprintf(key, 32, "ring-key-%u", k);
+        keys.push_back(key);
+    }
+    
+    unsigned long int took = waitForOwners(nodes, live, ring, keys, SETTLE_TIMEOUT);
+    if (took >= SETTLE_TIMEOUT) {
+        printf("FAIL: lookups did not settle after %u nodes joined\n", NODES);
+        return 1;
+    }
+    printf("Ring of %u nodes settled in %lu ms\n", NODES, took / 1000);
+    
+    // Stop a node other than the join point; its keys move to its successor
+    unsigned int victim = NODES / 2;
+    nodes[victim]->stop();
+    live[victim] = false;
+    ring.erase(find(ring.begin(), ring.end(), make_pair(nodes[victim]->getHashedKey(addresses[victim]), APP_PORT + victim)));
+    
+    took = waitForOwners(nodes, live, ring, keys, RECOVERY_TIMEOUT);
+    if (took >= RECOVERY_TIMEOUT) {
+        printf("FAIL: lookups did not return the right owners within %lu ms of %s stopping\n",
+                RECOVERY_TIMEOUT / 1000, addresses[victim]);
+        return 1;
+    }
+    printf("Lookups recovered %lu ms after %s stopped\n", took / 1000, addresses[victim]);
+    
+    unsigned long int start = getTimeInUSeconds();
+    unsigned int wrong = 0, rounds = 0;
+    while (getTimeInUSeconds() - start < HOLD_TIME) {
+        wrong += checkLookups(nodes, live, ring, keys);
+        ++rounds;
+        usleep(250000);
+    }
+    
+    if (wrong > 0) {
+        printf("FAIL: %u of %u lookups returned the wrong owner after recovering\n", wrong, rounds * KEYS * (NODES - 1));
+        return 1;
+    }
+    
+    for (unsigned int i = 0; i < NODES; ++i) {
+        nodes[i]->stop();
+    }
+    printf("PASS: %u lookups over %lu ms returned the right owners\n", rounds * KEYS * (NODES - 1), HOLD_TIME / 1000);
+    
+    return 0;
+}
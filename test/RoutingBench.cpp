@@ -0,0 +1,147 @@
+#include <algorithm>
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+#include "../include/Chord.hpp"
+#include "../include/Utils.hpp"
+
+using namespace std;
+
+const unsigned int LOOKUPS = 1000000;
+
+class RoutingBench {
+public:
+    static bool run(unsigned int ringSize);
+    
+private:
+    static node *ownerOf(const vector<pair<uint32_t, node *> > &ring, uint32_t key);
+    static node *scanFingers(Chord &chord, uint32_t key);
+};
+
+static inline uint32_t distance(uint32_t from, uint32_t to) {
+    return to - from;
+}
+
+static inline uint32_t nextKey(uint32_t &state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+/**
+ * Finds the node responsible for a key, from all IDs of the ring in order
+ */
+node *RoutingBench::ownerOf(const vector<pair<uint32_t, node *> > &ring, uint32_t key) {
+    vector<pair<uint32_t, node *> >::const_iterator it = lower_bound(ring.begin(), ring.end(), make_pair(key, (node *) NULL));
+    return (it == ring.end()) ? ring[0].second : it->second;
+}
+
+/**
+ * The closest preceding finger by looking at every finger, to check the
+ * search in getSuccessorOf against and to time it against
+ */
+node *RoutingBench::scanFingers(Chord &chord, uint32_t key) {
+    uint32_t toKey = distance(chord.hashedId, key);
+    node *ret = NULL;
+    uint32_t best = 0;
+    
+    SnapshotCell<routingTable>::Reader table(chord.routing);
+    for (unsigned int i = 0; i < CHORD_LENGTH_BIT; ++i) {
+        node *f = table->fingers[i];
+        if (f == NULL) {
+            continue;
+        }
+        
+        uint32_t toFinger = distance(chord.hashedId, f->hashedId);
+        if (toFinger > 0 && toFinger < toKey && toFinger > best) {
+            best = toFinger;
+            ret = f;
+        }
+    }
+    
+    if (ret == NULL && table->successorCount > 0) {
+        ret = table->successors[0];
+    }
+    
+    return ret;
+}
+
+/**
+ * Builds the finger table of one node in a ring of the given size, checks
+ * that getSuccessorOf picks the closest preceding finger and times it
+ *
+ * @return  False if some routing decision was wrong
+ */
+bool RoutingBench::run(unsigned int ringSize) {
+    Chord chord(5000, 45000, (char *) "127.0.0.1");
+    chord.init();
+    
+    vector<pair<uint32_t, node *> > ring;
+    ring.push_back(make_pair(chord.hashedId, chord.getPeer(NULL)));
+    for (unsigned int i = 1; i < ringSize; ++i) {
+        char ip[INET_ADDRSTRLEN];
+        snprintf(ip, sizeof(ip), "10.%u.%u.%u", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+        node *n = chord.getPeer(ip, 5000);
+        ring.push_back(make_pair(n->hashedId, n));
+    }
+    sort(ring.begin(), ring.end());
+    
+    for (unsigned int i = 0; i < CHORD_LENGTH_BIT; ++i) {
+        chord.setFingers((uint64_t) 1 << i, ownerOf(ring, chord.fingerStart[i]));
+    }
+    chord.setSuccessor(ownerOf(ring, chord.hashedId + 1));
+    
+    vector<uint32_t> keys(LOOKUPS);
+    uint32_t state = 2463534242u;
+    for (unsigned int i = 0; i < LOOKUPS; ++i) {
+        keys[i] = nextKey(state);
+    }
+    
+    unsigned int wrong = 0;
+    for (unsigned int i = 0; i < LOOKUPS; ++i) {
+        if (chord.getSuccessorOf(keys[i]) != scanFingers(chord, keys[i])) {
+            ++wrong;
+        }
+    }
+    
+    if (wrong > 0) {
+        printf("FAIL: %u of %u routing decisions in a ring of %u differ from a scan of all fingers\n", wrong, LOOKUPS, ringSize);
+        return false;
+    }
+    
+    // Summed so that the calls cannot be optimized away
+    uint32_t sum = 0;
+    unsigned long int start = getTimeInUSeconds();
+    for (unsigned int i = 0; i < LOOKUPS; ++i) {
+        sum += chord.getSuccessorOf(keys[i])->hashedId;
+    }
+    unsigned long int searchTime = getTimeInUSeconds() - start;
+    
+    start = getTimeInUSeconds();
+    for (unsigned int i = 0; i < LOOKUPS; ++i) {
+        sum += scanFingers(chord, keys[i])->hashedId;
+    }
+    unsigned long int scanTime = getTimeInUSeconds() - start;
+    
+    printf("getSuccessorOf, ring of %u nodes, %u lookups (checksum %u)\n", ringSize, LOOKUPS, sum);
+    printf("  highest finger first:  %6.1f ns/hop\n", searchTime * 1000.0 / LOOKUPS);
+    printf("  scan of all fingers:   %6.1f ns/hop\n", scanTime * 1000.0 / LOOKUPS);
+    
+    return true;
+}
+
+/**
+ * Times the per-hop routing decision for a few ring sizes
+ */
+int main() {
+    const unsigned int sizes[] = { 16, 256, 4096 };
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        if (!RoutingBench::run(sizes[i])) {
+            return 1;
+        }
+    }
+    
+    return 0;
+}